@@ -0,0 +1,194 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <bit>
+#include <format>
+
+#include "Analysis.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	int32_t CountBits(const uint64_t* bits, int32_t first, int32_t last)
+	{
+		int32_t n = 0;
+		while (first < last)
+		{
+			int32_t bit = first & 63;
+			int32_t take = min(64 - bit, last - first);
+			uint64_t mask = (take == 64 ? ~0ull : (1ull << take) - 1) << bit;
+			n += popcount(bits[first >> 6] & mask);
+			first += take;
+		}
+		return n;
+	}
+
+	int32_t MinuteOfWeek(local_minutes m)
+	{
+		local_days d = floor<days>(m);
+		return weekday{ d }.c_encoding() * WeekIndex::minutesPerDay + (int32_t)(m - d).count();
+	}
+
+	string Escape(const string& s, bool json)
+	{
+		string out;
+		for (char c : s)
+		{
+			if (json && (c == '"' || c == '\\')) out += '\\';
+			if (!json && c == '"') out += '"';
+			out += c;
+		}
+		return out;
+	}
+}
+
+int32_t CountMinutes(const WeekIndex& week, int32_t first, int32_t last)
+{
+	return CountBits(week.bits, first, last);
+}
+
+int32_t RunEnd(const WeekIndex& week, int32_t m, bool value)
+{
+	while (m < WeekIndex::minutesPerWeek)
+	{
+		// Looking for the first bit that is not value, so invert runs of ones
+		uint64_t w = (value ? ~week.bits[m >> 6] : week.bits[m >> 6]) >> (m & 63);
+		if (w != 0) return min(m + countr_zero(w), WeekIndex::minutesPerWeek);
+		m = (m | 63) + 1;
+	}
+	return WeekIndex::minutesPerWeek;
+}
+
+YearInfo LoadYear(int year, const time_zone* zone)
+{
+	YearInfo info;
+	info.year = year;
+	info.first = local_days{ std::chrono::year{ year } / January / 1 };
+	info.next = local_days{ std::chrono::year{ year + 1 } / January / 1 };
+
+	sys_seconds yearEnd{ info.next.time_since_epoch() + days{ 1 } };
+	sys_info before = zone->get_info(sys_seconds{ info.first.time_since_epoch() - days{ 1 } });
+
+	while (before.end < yearEnd)
+	{
+		sys_info after = zone->get_info(before.end);
+		local_minutes at = floor<minutes>(local_seconds{ (before.end + before.offset).time_since_epoch() });
+
+		if (after.offset != before.offset && at >= info.first && at < info.next)
+		{
+			info.changes.push_back({ at, duration_cast<minutes>(after.offset - before.offset) });
+		}
+		before = after;
+	}
+
+	return info;
+}
+
+ScheduleReport Analyse(const WeekIndex& week, const WeekIndex& peak, const YearInfo& year)
+{
+	ScheduleReport r;
+
+	uint64_t peakBits[WeekIndex::wordCount];
+	for (size_t i = 0; i < WeekIndex::wordCount; i++)
+	{
+		peakBits[i] = week.bits[i] & peak.bits[i];
+		r.peakMinutes += popcount(peakBits[i]);
+	}
+
+	int32_t peakDay[7];
+	for (int d = 0; d < 7; d++)
+	{
+		r.dayMinutes[d] = CountBits(week.bits, d * WeekIndex::minutesPerDay, (d + 1) * WeekIndex::minutesPerDay);
+		peakDay[d] = CountBits(peakBits, d * WeekIndex::minutesPerDay, (d + 1) * WeekIndex::minutesPerDay);
+		r.weekMinutes += r.dayMinutes[d];
+	}
+
+	// Awake runs, joining the one that ends the week with the one that starts it
+	int32_t leading = 0, trailing = 0;
+	for (int32_t m = 0; m < WeekIndex::minutesPerWeek;)
+	{
+		bool asleep = week.Test(m);
+		int32_t end = RunEnd(week, m, asleep);
+		if (!asleep)
+		{
+			if (m == 0) leading = end;
+			if (end == WeekIndex::minutesPerWeek) trailing = end - m;
+			r.longestAwake = max(r.longestAwake, end - m);
+		}
+		m = end;
+	}
+	if (leading != WeekIndex::minutesPerWeek) r.longestAwake = max(r.longestAwake, leading + trailing);
+
+	// Windows are already joined across the end of the week
+	r.windowCount = (int32_t)week.windows.size();
+	for (const MinuteWindow& w : week.windows)
+	{
+		int32_t length = w.end - w.start;
+		r.longestSleep = max(r.longestSleep, length);
+		r.lengthBuckets[upper_bound(begin(ScheduleReport::bucketLimits), end(ScheduleReport::bucketLimits), length) - begin(ScheduleReport::bucketLimits)]++;
+	}
+
+	r.year = year.year;
+	unsigned firstDay = weekday{ year.first }.c_encoding();
+	for (int i = 0, n = (year.next - year.first).count(); i < n; i++)
+	{
+		r.yearMinutes += r.dayMinutes[(firstDay + i) % 7];
+		r.yearPeakMinutes += peakDay[(firstDay + i) % 7];
+	}
+
+	// Springing forward skips [at, at + delta) on the wall clock, falling back
+	// repeats [at + delta, at)
+	for (const auto& [at, delta] : year.changes)
+	{
+		local_minutes from = delta.count() > 0 ? at : at + delta;
+		local_minutes to = delta.count() > 0 ? at + delta : at;
+		int sign = delta.count() > 0 ? -1 : 1;
+
+		for (local_minutes m = from; m < to; m += minutes{ 1 })
+		{
+			int32_t mw = MinuteOfWeek(m);
+			if (week.Test(mw)) r.yearMinutes += sign;
+			if (week.Test(mw) && peak.Test(mw)) r.yearPeakMinutes += sign;
+		}
+	}
+
+	return r;
+}
+
+void WriteReportHeader(ostream& out, bool json)
+{
+	if (json)
+	{
+		out << "[" << endl;
+		return;
+	}
+
+	out << "name,sun,mon,tue,wed,thu,fri,sat,week,longest_sleep,longest_awake,windows,"
+		"under_1h,1h_2h,2h_4h,4h_8h,8h_12h,12h_24h,over_24h,peak,year,year_total,year_peak" << endl;
+}
+
+void WriteReport(ostream& out, const ScheduleReport& r, bool json, bool first)
+{
+	const int32_t* d = r.dayMinutes;
+	const int32_t* b = r.lengthBuckets;
+
+	if (json)
+	{
+		out << (first ? "" : ",\n") << format(
+			"  {{\"name\": \"{}\", \"days\": [{}, {}, {}, {}, {}, {}, {}], \"week\": {}, \"longestSleep\": {}, \"longestAwake\": {}, "
+			"\"windows\": {}, \"lengthBuckets\": [{}, {}, {}, {}, {}, {}, {}], \"peak\": {}, \"year\": {}, \"yearTotal\": {}, \"yearPeak\": {}}}",
+			Escape(r.name, true), d[0], d[1], d[2], d[3], d[4], d[5], d[6], r.weekMinutes, r.longestSleep, r.longestAwake,
+			r.windowCount, b[0], b[1], b[2], b[3], b[4], b[5], b[6], r.peakMinutes, r.year, r.yearMinutes, r.yearPeakMinutes);
+		return;
+	}
+
+	out << format("\"{}\",{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{}",
+		Escape(r.name, false), d[0], d[1], d[2], d[3], d[4], d[5], d[6], r.weekMinutes, r.longestSleep, r.longestAwake,
+		r.windowCount, b[0], b[1], b[2], b[3], b[4], b[5], b[6], r.peakMinutes, r.year, r.yearMinutes, r.yearPeakMinutes) << endl;
+}
+
+void WriteReportFooter(ostream& out, bool json)
+{
+	if (json) out << endl << "]" << endl;
+}
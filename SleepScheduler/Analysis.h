@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Schedule.h"
+
+struct ScheduleReport
+{
+	static constexpr int bucketCount = 7;
+	// Upper bounds (exclusive, minutes) of the window length buckets; the last is open
+	static constexpr int32_t bucketLimits[bucketCount - 1] = { 60, 2 * 60, 4 * 60, 8 * 60, 12 * 60, 24 * 60 };
+
+	std::string name;
+
+	int32_t dayMinutes[7] = {}; // Sunday - Saturday
+	int32_t weekMinutes = 0;
+	int32_t longestSleep = 0;
+	int32_t longestAwake = 0;
+	int32_t windowCount = 0;
+	int32_t lengthBuckets[bucketCount] = {};
+	int32_t peakMinutes = 0; // Asleep during peak hours, per week
+
+	int year = 0;
+	// Minutes actually spent asleep over the year, so nights that span a DST
+	// change count the hour that was skipped or repeated correctly
+	int64_t yearMinutes = 0;
+	int64_t yearPeakMinutes = 0;
+};
+
+// Counts set bits in [first, last) of a week bitmap.
+int32_t CountMinutes(const WeekIndex& week, int32_t first, int32_t last);
+
+// First minute at or after m whose bit differs from value, or minutesPerWeek.
+int32_t RunEnd(const WeekIndex& week, int32_t m, bool value);
+
+// The calendar of one year in one zone. Loading it asks the zone database
+// for every transition, so it is shared by every schedule in a report.
+struct YearInfo
+{
+	int year = 0;
+	std::chrono::local_days first;
+	std::chrono::local_days next;
+	// Local wall-clock time of each UTC offset change, and how far the clock moved
+	std::vector<std::pair<std::chrono::local_minutes, std::chrono::minutes>> changes;
+};
+
+YearInfo LoadYear(int year, const std::chrono::time_zone* zone);
+
+// Everything comes from popcounts and run scans over the minute bitmap.
+ScheduleReport Analyse(const WeekIndex& week, const WeekIndex& peak, const YearInfo& year);
+
+void WriteReportHeader(std::ostream& out, bool json);
+void WriteReport(std::ostream& out, const ScheduleReport& report, bool json, bool first);
+void WriteReportFooter(std::ostream& out, bool json);
@@ -0,0 +1,95 @@
+// Linux build of the power backends: times each backend like
+// --benchmark-backends does on Windows, and checks that a new registration
+// replaces the relauncher of the one before. The scheduler itself only
+// builds on Windows; see Makefile.
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+#include "PowerBackend.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	// Kills are asynchronous, give a stopped relauncher a moment to go
+	bool Stopped(int pid)
+	{
+		for (int i = 0; i < 100; i++)
+		{
+			if (!LinuxBackend::IsRelauncher(pid)) return true;
+			this_thread::sleep_for(milliseconds(10));
+		}
+		return false;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+	cout << fixed << setprecision(0);
+
+	// The stand-in's cost is the floor for the suspend path
+	RecordingBackend recordingBackend;
+	BackendTiming recorded = BenchmarkBackend(recordingBackend, iterations, true, true);
+	cout << recordingBackend.Name() << ": privilege " << recorded.privilege << " ns, suspend " << recorded.suspend << " ns, relaunch " << recorded.relaunch << " ns." << endl;
+
+	char self[PATH_MAX];
+	ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (length <= 0)
+	{
+		cout << "Cannot get application path." << endl;
+		return 1;
+	}
+	self[length] = '\0';
+
+	LinuxBackend linuxBackend(self);
+	try
+	{
+		BackendTiming timing = BenchmarkBackend(linuxBackend, max(iterations / 1000, 1), false, false);
+		cout << linuxBackend.Name() << ": privilege " << timing.privilege << " ns." << endl;
+	}
+	catch (const std::exception& e)
+	{
+		cout << linuxBackend.Name() << ": " << e.what() << endl;
+	}
+
+	// Registrations far in the future, so nothing is ever relaunched
+	sys_seconds far = sys_days{ year{ 2100 } / 1 / 1 };
+	int failures = 0;
+
+	if (!linuxBackend.RelaunchAt(far, false) || linuxBackend.Pending() <= 0)
+	{
+		cout << "First registration did not leave a relauncher waiting." << endl;
+		linuxBackend.CancelPending();
+		return 1;
+	}
+	int first = linuxBackend.Pending();
+
+	auto begin = steady_clock::now();
+	bool ok = linuxBackend.RelaunchAt(far, false);
+	double relaunch = duration<double, micro>(steady_clock::now() - begin).count();
+	int second = linuxBackend.Pending();
+	cout << linuxBackend.Name() << ": relaunch " << relaunch << " us." << endl;
+
+	if (!ok || second <= 0 || second == first || !Stopped(first))
+	{
+		cout << "Second registration did not replace the first." << endl;
+		failures++;
+	}
+
+	linuxBackend.CancelPending();
+	if (second > 0 && !Stopped(second))
+	{
+		cout << "Relauncher still waiting after cancelling." << endl;
+		failures++;
+	}
+
+	return failures > 0 ? 1 : 0;
+}
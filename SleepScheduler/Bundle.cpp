@@ -0,0 +1,204 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <windows.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <map>
+
+#include "Bundle.h"
+
+using namespace std;
+
+namespace
+{
+	string Lower(string s)
+	{
+		transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return (char)tolower(c); });
+		return s;
+	}
+
+	struct Handle
+	{
+		HANDLE h;
+		~Handle() { if (h != NULL && h != INVALID_HANDLE_VALUE) CloseHandle(h); }
+	};
+
+	// A read-only view of [offset, offset + size). Views must start on the
+	// allocation granularity, so the mapping starts just below offset.
+	struct View
+	{
+		void* base = NULL;
+		const uint8_t* data = NULL;
+
+		View(HANDLE mapping, uint64_t offset, size_t size)
+		{
+			static const DWORD granularity = []() { SYSTEM_INFO si; GetSystemInfo(&si); return si.dwAllocationGranularity; }();
+
+			uint64_t aligned = offset / granularity * granularity;
+			base = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(aligned >> 32), (DWORD)aligned, (SIZE_T)(offset - aligned + size));
+			if (base == NULL) throw exception(format("Cannot map bundle ({}).", GetLastError()).c_str());
+			data = (const uint8_t*)base + (offset - aligned);
+		}
+		~View() { UnmapViewOfFile(base); }
+	};
+}
+
+void SerializeEntry(const WeekIndex& week, const SecondIndex* seconds, BundleInput& out)
+{
+	BundleEntry header = {};
+	header.magic = bundleEntryMagic;
+	header.secondResolution = seconds != nullptr;
+	header.minuteWindows = (uint32_t)week.windows.size();
+	header.secondWindows = seconds != nullptr ? (uint32_t)seconds->windows.size() : 0;
+	memcpy(header.bits, week.bits, sizeof(header.bits));
+
+	size_t minuteBytes = week.windows.size() * sizeof(MinuteWindow);
+	size_t secondBytes = header.secondWindows * sizeof(SecondWindow);
+
+	out.entry.resize(sizeof(header) + minuteBytes + secondBytes);
+	memcpy(out.entry.data(), &header, sizeof(header));
+	memcpy(out.entry.data() + sizeof(header), week.windows.data(), minuteBytes);
+	if (secondBytes > 0) memcpy(out.entry.data() + sizeof(header) + minuteBytes, seconds->windows.data(), secondBytes);
+
+	out.hash = Fnv1a(out.entry.data(), out.entry.size());
+}
+
+BundleStats WriteBundle(const char* path, vector<BundleInput>& inputs)
+{
+	for (BundleInput& input : inputs)
+	{
+		input.host = Lower(input.host);
+		if (input.host.empty() || input.host.size() >= sizeof(BundleHost::name)) throw exception(format("Invalid host name ({}).", input.host).c_str());
+		if (input.zone.size() >= sizeof(BundleHost::zone)) throw exception(format("Time zone name too long ({}).", input.zone).c_str());
+	}
+
+	// Sorted, so a host finds itself with a binary search
+	sort(inputs.begin(), inputs.end(), [](const BundleInput& a, const BundleInput& b) { return a.host < b.host; });
+	auto duplicate = adjacent_find(inputs.begin(), inputs.end(), [](const BundleInput& a, const BundleInput& b) { return a.host == b.host; });
+	if (duplicate != inputs.end()) throw exception(format("Host listed twice ({}).", duplicate->host).c_str());
+
+	vector<BundleHost> hosts(inputs.size());
+	vector<const BundleInput*> entries;
+	map<uint64_t, size_t> byHash;
+
+	uint64_t offset = sizeof(BundleHeader) + hosts.size() * sizeof(BundleHost);
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		const BundleInput& input = inputs[i];
+		BundleHost& host = hosts[i];
+
+		auto it = byHash.find(input.hash);
+		if (it != byHash.end() && inputs[it->second].entry == input.entry)
+		{
+			host.offset = hosts[it->second].offset;
+		}
+		else
+		{
+			// A genuine collision just stores both, the host table has the offsets
+			if (it == byHash.end()) byHash[input.hash] = i;
+			offset = (offset + 7) & ~7ull;
+			host.offset = offset;
+			offset += input.entry.size();
+			entries.push_back(&input);
+		}
+
+		strncpy(host.name, input.host.c_str(), sizeof(host.name));
+		strncpy(host.zone, input.zone.c_str(), sizeof(host.zone));
+		host.hash = input.hash;
+		host.size = (uint32_t)input.entry.size();
+		host.sleepInterval = input.sleepInterval;
+		host.onLogon = input.onLogon;
+	}
+
+	BundleHeader header = {};
+	header.magic = bundleMagic;
+	header.hostCount = (uint32_t)hosts.size();
+	header.entryCount = (uint32_t)entries.size();
+	header.size = offset;
+
+	ofstream out(path, ios::binary);
+	if (!out.is_open()) throw exception(format("Cannot open bundle ({}).", path).c_str());
+
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)hosts.data(), hosts.size() * sizeof(BundleHost));
+
+	uint64_t written = sizeof(BundleHeader) + hosts.size() * sizeof(BundleHost);
+	const char padding[8] = {};
+	for (const BundleInput* entry : entries)
+	{
+		uint64_t aligned = (written + 7) & ~7ull;
+		out.write(padding, aligned - written);
+		out.write((const char*)entry->entry.data(), entry->entry.size());
+		written = aligned + entry->entry.size();
+	}
+
+	out.close();
+	if (out.fail()) throw exception(format("Cannot write bundle ({}).", path).c_str());
+
+	return { hosts.size(), entries.size(), (size_t)header.size };
+}
+
+bool ReadBundle(const char* path, string host, BundleSchedule& out)
+{
+	host = Lower(host);
+
+	Handle file{ CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL) };
+	if (file.h == INVALID_HANDLE_VALUE) throw exception(format("Cannot open bundle ({}).", path).c_str());
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file.h, &fileSize) || (uint64_t)fileSize.QuadPart < sizeof(BundleHeader)) throw exception(format("Bundle is damaged ({}).", path).c_str());
+
+	Handle mapping{ CreateFileMappingA(file.h, NULL, PAGE_READONLY, 0, 0, NULL) };
+	if (mapping.h == NULL) throw exception(format("Cannot map bundle ({}).", GetLastError()).c_str());
+
+	BundleHost entry;
+	{
+		View table(mapping.h, 0, sizeof(BundleHeader));
+		BundleHeader header;
+		memcpy(&header, table.data, sizeof(header));
+
+		if (header.magic != bundleMagic || header.size != (uint64_t)fileSize.QuadPart || sizeof(BundleHeader) + (uint64_t)header.hostCount * sizeof(BundleHost) > header.size)
+		{
+			throw exception(format("Bundle is damaged ({}).", path).c_str());
+		}
+
+		View hosts(mapping.h, sizeof(BundleHeader), header.hostCount * sizeof(BundleHost));
+		const BundleHost* first = (const BundleHost*)hosts.data;
+		const BundleHost* last = first + header.hostCount;
+
+		const BundleHost* it = lower_bound(first, last, host, [](const BundleHost& h, const string& name) { return strncmp(h.name, name.c_str(), sizeof(h.name)) < 0; });
+		if (it == last || strncmp(it->name, host.c_str(), sizeof(it->name)) != 0) return false;
+
+		entry = *it;
+	}
+
+	if (entry.size < sizeof(BundleEntry) || entry.offset + entry.size > (uint64_t)fileSize.QuadPart) throw exception(format("Bundle entry is damaged ({}).", host).c_str());
+
+	View view(mapping.h, entry.offset, entry.size);
+	if (Fnv1a(view.data, entry.size) != entry.hash) throw exception(format("Bundle entry is damaged ({}).", host).c_str());
+
+	BundleEntry header;
+	memcpy(&header, view.data, sizeof(header));
+	if (header.magic != bundleEntryMagic || sizeof(header) + (uint64_t)header.minuteWindows * sizeof(MinuteWindow) + (uint64_t)header.secondWindows * sizeof(SecondWindow) != entry.size)
+	{
+		throw exception(format("Bundle entry is damaged ({}).", host).c_str());
+	}
+
+	const uint8_t* p = view.data + sizeof(header);
+	memcpy(out.weekIndex.bits, header.bits, sizeof(header.bits));
+	out.weekIndex.windows.resize(header.minuteWindows);
+	memcpy(out.weekIndex.windows.data(), p, header.minuteWindows * sizeof(MinuteWindow));
+	p += header.minuteWindows * sizeof(MinuteWindow);
+
+	out.secondResolution = header.secondResolution != 0;
+	out.secondIndex.windows.resize(header.secondWindows);
+	memcpy(out.secondIndex.windows.data(), p, header.secondWindows * sizeof(SecondWindow));
+
+	out.sleepInterval = entry.sleepInterval;
+	out.onLogon = entry.onLogon != 0;
+	out.zone.assign(entry.zone, strnlen(entry.zone, sizeof(entry.zone)));
+	return true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Schedule.h"
+
+// Compiled schedules for a whole fleet in one file. Hosts with the same
+// merged week share one entry, addressed by the FNV-1a hash of its bytes, so
+// the file grows with the number of distinct weeks rather than hosts.
+// Layout: BundleHeader, BundleHost[hostCount] sorted by name, then the
+// entries. A host maps the table, then only its own entry.
+#pragma pack(push, 1)
+struct BundleHeader
+{
+	uint32_t magic;
+	uint32_t hostCount;
+	uint32_t entryCount;
+	uint32_t reserved;
+	uint64_t size; // Of the whole file
+};
+
+struct BundleHost
+{
+	char name[64]; // Lower case, NUL padded
+	char zone[48]; // Empty for the local wall clock
+	uint64_t hash; // Of the entry
+	uint64_t offset;
+	uint32_t size;
+	int32_t sleepInterval;
+	uint8_t onLogon;
+	uint8_t reserved[7];
+};
+
+// Followed by minuteWindows MinuteWindows, then secondWindows SecondWindows.
+struct BundleEntry
+{
+	uint32_t magic;
+	uint32_t secondResolution;
+	uint32_t minuteWindows;
+	uint32_t secondWindows;
+	uint64_t bits[WeekIndex::wordCount];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(BundleHost) == 144);
+
+constexpr uint32_t bundleMagic = 0x31425353;      // "SSB1"
+constexpr uint32_t bundleEntryMagic = 0x45425353; // "SSBE"
+constexpr char bundleName[] = "schedule.bundle";
+
+// One host's schedule on its way into a bundle
+struct BundleInput
+{
+	std::string host;
+	int sleepInterval = 0;
+	bool onLogon = false;
+	std::string zone;
+	std::vector<uint8_t> entry;
+	uint64_t hash = 0;
+};
+
+// One host's schedule as read back out of a bundle
+struct BundleSchedule
+{
+	WeekIndex weekIndex;
+	bool secondResolution = false;
+	SecondIndex secondIndex;
+	int sleepInterval = 0;
+	bool onLogon = false;
+	std::string zone;
+};
+
+struct BundleStats
+{
+	size_t hosts = 0;
+	size_t entries = 0;
+	size_t bytes = 0;
+};
+
+// Fills in entry and hash from the compiled indexes. seconds is only given
+// for second resolution schedules.
+void SerializeEntry(const WeekIndex& week, const SecondIndex* seconds, BundleInput& out);
+
+// Writes every distinct entry once. Throws on duplicate or overlong host
+// names and on I/O errors.
+BundleStats WriteBundle(const char* path, std::vector<BundleInput>& inputs);
+
+// Returns false if the host is not in the bundle. Throws if the bundle or
+// the host's entry is damaged.
+bool ReadBundle(const char* path, std::string host, BundleSchedule& out);
@@ -0,0 +1,34 @@
+// Coverage-guided fuzzing entry point for the merge and the compiled
+// indexes, checked against a brute-force scan of the spans. Build as
+// ParseFuzzer.cpp describes, with this file instead.
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../ScheduleFile.h"
+
+using namespace std;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	istringstream in(string((const char*)data, size));
+	try
+	{
+		ParseSchedule(in);
+		MergeSchedule();
+	}
+	catch (const std::exception&)
+	{
+		return 0;
+	}
+
+	string error;
+	if (!VerifySpans(error) || !VerifyIndex(error))
+	{
+		cerr << error << endl;
+		abort();
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+// Coverage-guided fuzzing entry point for the window lookups the scheduler
+// makes: Test, Containing and Next on every minute (or second) of the week,
+// and the projection of a zoned schedule onto another zone. The last two
+// bytes of the input pick the zone and the week; the rest is the schedule.
+// Build as ParseFuzzer.cpp describes, with this file instead.
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include "../ScheduleFile.h"
+
+using namespace std;
+using namespace std::chrono;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (size < 2) return 0;
+
+	istringstream in(string((const char*)data, size - 2));
+	try
+	{
+		ParseSchedule(in);
+		MergeSchedule();
+	}
+	catch (const std::exception&)
+	{
+		return 0;
+	}
+
+	string error;
+	bool ok = VerifyIndex(error);
+
+	if (ok && scheduleZone != NULL && !secondResolution)
+	{
+		// Every Sunday of March and October from 2000 to 2031, where the DST changes are
+		uint8_t pick = data[size - 1];
+		local_days week{ year(2000 + (pick >> 3)) / ((pick & 4) ? October : March) / Sunday[1 + (pick & 3)] };
+		ok = VerifyProjection(weekIndex, scheduleZone, locate_zone(fuzzZones[data[size - 2] % std::size(fuzzZones)]), week, error);
+	}
+
+	if (!ok)
+	{
+		cerr << error << endl;
+		abort();
+	}
+	return 0;
+}
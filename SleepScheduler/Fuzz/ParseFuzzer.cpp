@@ -0,0 +1,36 @@
+// Coverage-guided fuzzing entry point for the schedule parser. Built with
+// libFuzzer from the project folder (Visual Studio 2019 16.9 or later):
+//   cl /std:c++20 /EHsc /O2 /Zi /fsanitize=address /fsanitize=fuzzer Fuzz\ParseFuzzer.cpp ScheduleFile.cpp Projection.cpp
+//   ParseFuzzer.exe -dict=Fuzz\schedule.dict Fuzz\corpus
+// Any AFL-style driver that calls LLVMFuzzerTestOneInput works as well.
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../ScheduleFile.h"
+
+using namespace std;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	istringstream in(string((const char*)data, size));
+	try
+	{
+		ParseSchedule(in);
+	}
+	catch (const std::exception&)
+	{
+		// Rejecting the input is fine, only a crash or broken spans are bugs
+		return 0;
+	}
+
+	string error;
+	if (!VerifySpans(error))
+	{
+		cerr << error << endl;
+		abort();
+	}
+	return 0;
+}
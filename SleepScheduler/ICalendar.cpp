@@ -0,0 +1,520 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <charconv>
+#include <chrono>
+#include <format>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "ICalendar.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	// BYDAY names, indexed like weekday::c_encoding()
+	constexpr string_view dayNames[7] = { "SU", "MO", "TU", "WE", "TH", "FR", "SA" };
+
+	enum class Frequency { None, Daily, Weekly, Other };
+
+	struct Event
+	{
+		bool hasStart = false;
+		bool hasEnd = false;
+		bool allDay = false;
+		bool cancelled = false;
+		local_seconds start{};
+		local_seconds end{};
+		seconds duration{ -1 };
+		Frequency frequency = Frequency::None;
+		uint8_t byDay = 0; // Bit 0 = Sunday
+		bool unknownZone = false;
+	};
+
+	// A STANDARD or DAYLIGHT block of a VTIMEZONE: the offset it switches to
+	// and, for a yearly rule, when it switches on the wall clock
+	struct Observance
+	{
+		bool present = false;
+		local_seconds since{}; // DTSTART
+		seconds offset{ 0 };   // TZOFFSETTO
+		unsigned byMonth = 0;  // 0 without a yearly rule
+		int week = 0;          // 1-4, or -1 (and 5) for the last
+		unsigned byWeekday = 0; // 0 = Sunday
+
+		// When the rule switches in year y
+		local_seconds In(year y) const
+		{
+			weekday wd{ byWeekday };
+			local_days d = week < 0 || week >= 5 ? local_days{ y / month{ byMonth } / wd[last] } : local_days{ y / month{ byMonth } / wd[(unsigned)week] };
+			return d + (since - floor<days>(since));
+		}
+	};
+
+	// A zone the calendar defines itself. Used for TZIDs the zone database
+	// does not know, such as the Windows zone names Outlook and Exchange write.
+	struct CalendarZone
+	{
+		Observance standard, daylight;
+
+		// Offset from UTC at a wall-clock time. Times within an hour of a
+		// change may be off by the difference, as with any wall-clock time.
+		seconds OffsetAt(local_seconds t) const
+		{
+			if (!daylight.present) return standard.offset;
+			if (!standard.present) return daylight.offset;
+
+			if (standard.byMonth != 0 && daylight.byMonth != 0)
+			{
+				year y = year_month_day{ floor<days>(t) }.year();
+				local_seconds toDaylight = daylight.In(y), toStandard = standard.In(y);
+				// Southern zones are on daylight time over the turn of the year
+				bool inDaylight = toDaylight < toStandard ? t >= toDaylight && t < toStandard : t >= toDaylight || t < toStandard;
+				return inDaylight ? daylight.offset : standard.offset;
+			}
+
+			// One-off changes: the latest one before t holds
+			if (daylight.since <= t && (daylight.since > standard.since || t < standard.since)) return daylight.offset;
+			return standard.offset;
+		}
+	};
+
+	int ParseInt(string_view s, size_t pos, size_t len)
+	{
+		int v = 0;
+		if (pos + len > s.size() || from_chars(s.data() + pos, s.data() + pos + len, v).ptr != s.data() + pos + len)
+		{
+			throw exception(format("Invalid number in calendar ({}).", s).c_str());
+		}
+		return v;
+	}
+
+	// +HHMM or +HHMMSS
+	seconds ParseOffset(string_view v)
+	{
+		if (v.size() != 5 && v.size() != 7 || v[0] != '+' && v[0] != '-') throw exception(format("Invalid offset in calendar ({}).", v).c_str());
+
+		seconds offset = hours{ ParseInt(v, 1, 2) } + minutes{ ParseInt(v, 3, 2) } + seconds{ v.size() == 7 ? ParseInt(v, 5, 2) : 0 };
+		return v[0] == '-' ? -offset : offset;
+	}
+
+	seconds ParseDuration(string_view v)
+	{
+		bool negative = !v.empty() && v[0] == '-';
+		if (!v.empty() && (v[0] == '-' || v[0] == '+')) v.remove_prefix(1);
+		if (v.empty() || v[0] != 'P') throw exception(format("Invalid duration in calendar ({}).", v).c_str());
+
+		seconds total{ 0 };
+		for (size_t i = 1; i < v.size();)
+		{
+			if (v[i] == 'T') { i++; continue; }
+
+			int n = 0;
+			auto r = from_chars(v.data() + i, v.data() + v.size(), n);
+			if (r.ptr == v.data() + i || r.ptr == v.data() + v.size()) throw exception(format("Invalid duration in calendar ({}).", v).c_str());
+			i = r.ptr - v.data();
+
+			switch (v[i++])
+			{
+			case 'W': total += weeks{ n }; break;
+			case 'D': total += days{ n }; break;
+			case 'H': total += hours{ n }; break;
+			case 'M': total += minutes{ n }; break;
+			case 'S': total += seconds{ n }; break;
+			default: throw exception(format("Invalid duration in calendar ({}).", v).c_str());
+			}
+		}
+
+		return negative ? -total : total;
+	}
+
+	string FormatOffset(seconds offset)
+	{
+		char sign = offset < seconds{ 0 } ? '-' : '+';
+		int64_t s = abs(offset.count());
+		string text = format("{}{:02}{:02}", sign, s / 3600, s / 60 % 60);
+		if (s % 60 != 0) text += format("{:02}", s % 60);
+		return text;
+	}
+
+	// The VTIMEZONE a TZID refers to, with yearly rules read off the zone's
+	// changes in year y. Later rule changes in the zone are not carried over.
+	void WriteTimeZone(ostream& out, const time_zone* zone, year y)
+	{
+		out << format("BEGIN:VTIMEZONE\r\nTZID:{}\r\n", zone->name());
+
+		sys_seconds end = sys_days{ (y + years{ 1 }) / January / 1 };
+		sys_info info = zone->get_info(sys_days{ y / January / 1 });
+		bool changes = false;
+		for (; info.end < end; changes = true)
+		{
+			sys_info next = zone->get_info(info.end);
+
+			// Observances start on the wall clock in effect before the change
+			local_seconds at{ (info.end + info.offset).time_since_epoch() };
+			local_days date = floor<days>(at);
+			year_month_day ymd{ date };
+			bool lastInMonth = year_month_day{ date + weeks{ 1 } }.month() != ymd.month();
+			string byDay = format("{}{}", lastInMonth ? -1 : (int)((unsigned)ymd.day() - 1) / 7 + 1, dayNames[weekday{ date }.c_encoding()]);
+			const char* kind = next.save != minutes{ 0 } ? "DAYLIGHT" : "STANDARD";
+
+			out << format("BEGIN:{}\r\nDTSTART:{:%Y%m%dT%H%M%S}\r\nRRULE:FREQ=YEARLY;BYMONTH={};BYDAY={}\r\nTZOFFSETFROM:{}\r\nTZOFFSETTO:{}\r\nEND:{}\r\n",
+				kind, at, (unsigned)ymd.month(), byDay, FormatOffset(info.offset), FormatOffset(next.offset), kind);
+			info = next;
+		}
+
+		if (!changes)
+		{
+			string offset = FormatOffset(info.offset);
+			out << format("BEGIN:STANDARD\r\nDTSTART:19700101T000000\r\nTZOFFSETFROM:{}\r\nTZOFFSETTO:{}\r\nEND:STANDARD\r\n", offset, offset);
+		}
+
+		out << "END:VTIMEZONE\r\n";
+	}
+
+	class Importer
+	{
+	private:
+		WeekIndex& week;
+		const time_zone* local;
+		// Calendars repeat the same TZID on every event, so keep the last lookup
+		string zoneName;
+		bool zoneCached = false;
+		const time_zone* zone = nullptr;
+		const CalendarZone* calendarZone = nullptr;
+		Event ev;
+		int depth = 0;
+
+		// VTIMEZONE blocks seen so far, and the one being read
+		map<string, CalendarZone, less<>> calendarZones;
+		bool inZone = false;
+		string definitionName;
+		CalendarZone definition;
+		Observance* observance = nullptr;
+		Observance block;
+
+		local_seconds ParseDateTime(string_view value, string_view params, bool& allDay)
+		{
+			year_month_day ymd{ year{ ParseInt(value, 0, 4) }, month{ (unsigned)ParseInt(value, 4, 2) }, day{ (unsigned)ParseInt(value, 6, 2) } };
+			if (!ymd.ok()) throw exception(format("Invalid date in calendar ({}).", value).c_str());
+
+			allDay = value.size() == 8;
+			if (allDay) return local_days{ ymd };
+
+			if (value.size() < 15 || value[8] != 'T') throw exception(format("Invalid time in calendar ({}).", value).c_str());
+			local_seconds t = local_days{ ymd } + hours{ ParseInt(value, 9, 2) } + minutes{ ParseInt(value, 11, 2) } + seconds{ ParseInt(value, 13, 2) };
+
+			if (value.size() > 15 && value[15] == 'Z')
+			{
+				return local->to_local(sys_seconds{ t.time_since_epoch() });
+			}
+
+			size_t tzid = params.find("TZID=");
+			if (tzid == string_view::npos) return t; // Floating time is already wall-clock
+
+			string_view name = params.substr(tzid + 5);
+			name = name.substr(0, name.find(';'));
+			if (!name.empty() && name.front() == '"') name = name.substr(1, name.find('"', 1) - 1);
+
+			if (!zoneCached || name != zoneName)
+			{
+				zoneName = name;
+				zoneCached = true;
+				zone = nullptr;
+				calendarZone = nullptr;
+
+				try
+				{
+					zone = locate_zone(name);
+				}
+				catch (const std::exception&)
+				{
+					auto it = calendarZones.find(name);
+					if (it != calendarZones.end()) calendarZone = &it->second;
+				}
+			}
+
+			if (zone != nullptr) return local->to_local(zone->to_sys(t, choose::earliest));
+			if (calendarZone != nullptr) return local->to_local(sys_seconds{ (t - calendarZone->OffsetAt(t)).time_since_epoch() });
+
+			// Neither known nor defined: the event is skipped, not the calendar
+			ev.unknownZone = true;
+			return t;
+		}
+
+		// FREQ=YEARLY;BYMONTH=10;BYDAY=-1SU, as VTIMEZONE observances use it
+		void ParseZoneRule(string_view rule)
+		{
+			while (!rule.empty())
+			{
+				string_view part = rule.substr(0, rule.find(';'));
+				rule.remove_prefix(min(rule.size(), part.size() + 1));
+
+				if (part.starts_with("BYMONTH=")) block.byMonth = (unsigned)ParseInt(part, 8, part.size() - 8);
+				if (!part.starts_with("BYDAY=") || part.size() < 9) continue;
+
+				string_view d = part.substr(6);
+				auto it = find(begin(dayNames), end(dayNames), d.substr(d.size() - 2));
+				if (it == end(dayNames) || d.size() == 2) continue;
+
+				if (d[0] == '+') d.remove_prefix(1);
+				block.week = ParseInt(d, 0, d.size() - 2);
+				block.byWeekday = (unsigned)(it - begin(dayNames));
+			}
+
+			if (block.byMonth > 12 || block.week == 0) block.byMonth = 0;
+		}
+
+		void ParseRule(string_view rule)
+		{
+			while (!rule.empty())
+			{
+				string_view part = rule.substr(0, rule.find(';'));
+				rule.remove_prefix(min(rule.size(), part.size() + 1));
+
+				if (part.starts_with("FREQ=")) ev.frequency = part == "FREQ=DAILY" ? Frequency::Daily : part == "FREQ=WEEKLY" ? Frequency::Weekly : Frequency::Other;
+				if (!part.starts_with("BYDAY=")) continue;
+
+				for (part.remove_prefix(6); !part.empty();)
+				{
+					// Ordinal prefixes ("1MO", "-1SU") only matter for monthly rules
+					string_view d = part.substr(0, part.find(','));
+					part.remove_prefix(min(part.size(), d.size() + 1));
+					if (d.size() < 2) continue;
+
+					auto it = find(begin(dayNames), end(dayNames), d.substr(d.size() - 2));
+					if (it != end(dayNames)) ev.byDay |= 1 << (it - begin(dayNames));
+				}
+			}
+		}
+
+		void Flush()
+		{
+			if (ev.unknownZone) { stats.skipped++; stats.unknownZones++; return; }
+			if (ev.cancelled || !ev.hasStart) { stats.skipped++; return; }
+
+			local_seconds end;
+			if (ev.hasEnd) end = ev.end;
+			else if (ev.duration.count() >= 0) end = ev.start + ev.duration;
+			else if (ev.allDay) end = ev.start + days{ 1 };
+			else { stats.skipped++; return; }
+
+			local_minutes first = floor<minutes>(ev.start);
+			int32_t length = (int32_t)min<int64_t>((ceil<minutes>(end) - first).count(), WeekIndex::minutesPerWeek);
+			if (length <= 0) { stats.skipped++; return; }
+
+			local_days date = floor<days>(first);
+			int32_t timeOfDay = (int32_t)(first - date).count();
+			unsigned wd = weekday{ date }.c_encoding();
+			// BYDAY limits a daily rule and lists a weekly one's days; monthly and
+			// yearly rules fall on too few of their days to fold, so they keep
+			// the day they start on like a one-off event
+			uint8_t mask = (uint8_t)(1 << wd);
+			if (ev.frequency == Frequency::Daily) mask = ev.byDay != 0 ? ev.byDay : 0x7F;
+			else if (ev.frequency == Frequency::Weekly && ev.byDay != 0) mask = ev.byDay;
+
+			for (int d = 0; d < 7; d++)
+			{
+				if (!(mask & (1 << d))) continue;
+				int32_t start = d * WeekIndex::minutesPerDay + timeOfDay;
+				week.SetRange(start, start + length - 1);
+			}
+
+			stats.events++;
+		}
+
+	public:
+		ICalendarStats stats;
+
+		Importer(WeekIndex& _week, const time_zone* _local) : week(_week), local(_local) {}
+
+		void Line(string_view line)
+		{
+			// Property names end at the first ';' or ':', the value after the first
+			// ':' that is not inside a quoted parameter
+			size_t colon = 0;
+			for (bool quoted = false; colon < line.size() && (quoted || line[colon] != ':'); colon++)
+			{
+				if (line[colon] == '"') quoted = !quoted;
+			}
+			if (colon == line.size()) return;
+
+			string_view head = line.substr(0, colon);
+			string_view value = line.substr(colon + 1);
+			string_view name = head.substr(0, head.find(';'));
+			string_view params = head.substr(name.size());
+
+			if (name == "BEGIN")
+			{
+				if (depth > 0) depth++;
+				else if (value == "VEVENT")
+				{
+					depth = 1;
+					ev = Event();
+				}
+				else if (value == "VTIMEZONE")
+				{
+					inZone = true;
+					definitionName.clear();
+					definition = CalendarZone();
+				}
+				else if (inZone && (value == "STANDARD" || value == "DAYLIGHT"))
+				{
+					observance = value == "STANDARD" ? &definition.standard : &definition.daylight;
+					block = Observance();
+					block.present = true;
+				}
+			}
+			else if (name == "END")
+			{
+				if (depth == 1) Flush();
+				if (depth > 0) depth--;
+				else if (observance != nullptr && (value == "STANDARD" || value == "DAYLIGHT"))
+				{
+					// Zones often list every historic change, the latest one is current
+					if (!observance->present || block.since >= observance->since) *observance = block;
+					observance = nullptr;
+				}
+				else if (inZone && value == "VTIMEZONE")
+				{
+					if (!definitionName.empty()) calendarZones[definitionName] = definition;
+					inZone = false;
+					zoneCached = false;
+				}
+			}
+			else if (observance != nullptr)
+			{
+				if (name == "TZOFFSETTO") block.offset = ParseOffset(value);
+				else if (name == "DTSTART")
+				{
+					bool allDay;
+					block.since = ParseDateTime(value, "", allDay);
+				}
+				else if (name == "RRULE") ParseZoneRule(value);
+			}
+			else if (inZone && name == "TZID") definitionName = value;
+			else if (depth == 1)
+			{
+				if (name == "DTSTART")
+				{
+					ev.start = ParseDateTime(value, params, ev.allDay);
+					ev.hasStart = true;
+				}
+				else if (name == "DTEND")
+				{
+					bool allDay;
+					ev.end = ParseDateTime(value, params, allDay);
+					ev.hasEnd = true;
+				}
+				else if (name == "DURATION") ev.duration = ParseDuration(value);
+				else if (name == "RRULE") ParseRule(value);
+				else if (name == "STATUS") ev.cancelled = value == "CANCELLED";
+			}
+		}
+	};
+}
+
+ICalendarStats ImportICalendar(istream& in, WeekIndex& week, const time_zone* zone)
+{
+	auto begin = steady_clock::now();
+	Importer importer(week, zone);
+
+	// Long lines are folded onto continuation lines starting with whitespace.
+	// Both buffers are reused, so memory stays at the longest logical line.
+	string physical, logical;
+	while (getline(in, physical))
+	{
+		importer.stats.bytes += physical.size() + 1;
+		if (!physical.empty() && physical.back() == '\r') physical.pop_back();
+
+		if (!physical.empty() && (physical[0] == ' ' || physical[0] == '\t'))
+		{
+			logical.append(physical, 1);
+			continue;
+		}
+
+		if (!logical.empty()) importer.Line(logical);
+		logical.swap(physical);
+	}
+	if (!logical.empty()) importer.Line(logical);
+
+	week.Compile();
+
+	importer.stats.elapsed = steady_clock::now() - begin;
+	return importer.stats;
+}
+
+void ExportICalendar(ostream& out, const WeekIndex& week, local_days firstSunday, int weekCount, const time_zone* zone)
+{
+	string stamp = format("{:%Y%m%dT%H%M%SZ}", floor<seconds>(system_clock::now()));
+	string tzid = zone != nullptr ? format(";TZID={}", zone->name()) : "";
+	size_t uid = 0;
+
+	out << "BEGIN:VCALENDAR\r\nVERSION:2.0\r\nPRODID:-//SleepScheduler//EN\r\n";
+	// Every TZID needs its VTIMEZONE in the same calendar
+	if (zone != nullptr) WriteTimeZone(out, zone, year_month_day{ firstSunday }.year());
+
+	for (int w = 0; w < max(weekCount, 1); w++)
+	{
+		for (const MinuteWindow& mw : week.windows)
+		{
+			local_minutes start = local_minutes{ firstSunday + weeks{ w } } + minutes{ mw.start };
+			local_minutes end = local_minutes{ firstSunday + weeks{ w } } + minutes{ mw.end };
+
+			out << format("BEGIN:VEVENT\r\nUID:sleepscheduler-{}@localhost\r\nDTSTAMP:{}\r\nDTSTART{}:{:%Y%m%dT%H%M%S}\r\nDTEND{}:{:%Y%m%dT%H%M%S}\r\n", uid++, stamp, tzid, start, tzid, end);
+			if (weekCount == 0) out << "RRULE:FREQ=WEEKLY\r\n";
+			out << "SUMMARY:Sleep\r\nEND:VEVENT\r\n";
+		}
+	}
+
+	out << "END:VCALENDAR\r\n";
+}
+
+void GenerateICalendar(ostream& out, size_t events, unsigned seed)
+{
+	mt19937 random(seed);
+	auto pick = [&](int n) { return (int)(random() % (unsigned)n); };
+
+	// A Windows zone name as Outlook writes it, only known through its VTIMEZONE
+	out << "BEGIN:VCALENDAR\r\nVERSION:2.0\r\nPRODID:-//SleepScheduler//Generated//EN\r\n"
+		"BEGIN:VTIMEZONE\r\nTZID:W. Europe Standard Time\r\n"
+		"BEGIN:STANDARD\r\nDTSTART:16010101T030000\r\nTZOFFSETFROM:+0200\r\nTZOFFSETTO:+0100\r\nRRULE:FREQ=YEARLY;BYDAY=-1SU;BYMONTH=10\r\nEND:STANDARD\r\n"
+		"BEGIN:DAYLIGHT\r\nDTSTART:16010101T020000\r\nTZOFFSETFROM:+0100\r\nTZOFFSETTO:+0200\r\nRRULE:FREQ=YEARLY;BYDAY=-1SU;BYMONTH=3\r\nEND:DAYLIGHT\r\n"
+		"END:VTIMEZONE\r\n";
+
+	static const char* const params[] = { "", ";TZID=W. Europe Standard Time", ";TZID=\"America/New_York\"", ";TZID=Europe/Berlin" };
+	static const char* const rules[] = { "", "", "RRULE:FREQ=DAILY\r\n", "RRULE:FREQ=DAILY;BYDAY=MO,TU\r\n", "RRULE:FREQ=WEEKLY;BYDAY=MO,WE,FR\r\n", "RRULE:FREQ=MONTHLY;BYDAY=1MO,-1SU\r\n" };
+
+	local_days first = local_days{ year{ 2020 } / January / 1 };
+	for (size_t i = 0; i < events; i++)
+	{
+		local_seconds start = first + days{ pick(3650) } + minutes{ pick(96) * 15 };
+		int kind = pick(16);
+
+		out << format("BEGIN:VEVENT\r\nUID:generated-{}@localhost\r\nDTSTAMP:20200101T000000Z\r\n", i);
+		if (kind == 0)
+		{
+			out << format("DTSTART;VALUE=DATE:{:%Y%m%d}\r\n", floor<days>(start));
+		}
+		else if (kind < 4)
+		{
+			out << format("DTSTART:{:%Y%m%dT%H%M%S}Z\r\nDURATION:PT{}M\r\n", start, 15 + pick(240));
+		}
+		else
+		{
+			const char* zone = params[pick((int)size(params))];
+			out << format("DTSTART{}:{:%Y%m%dT%H%M%S}\r\nDTEND{}:{:%Y%m%dT%H%M%S}\r\n", zone, start, zone, start + minutes{ 15 + pick(480) });
+		}
+
+		out << rules[pick((int)size(rules))];
+		if (pick(20) == 0) out << "STATUS:CANCELLED\r\n";
+		// Long descriptions get folded, as real calendars do past 75 octets
+		if (pick(4) == 0) out << "DESCRIPTION:Generated event with a description long enough to be fol\r\n ded onto a second line by the writer\r\n";
+		out << "SUMMARY:Busy\r\nEND:VEVENT\r\n";
+	}
+
+	out << "END:VCALENDAR\r\n";
+}
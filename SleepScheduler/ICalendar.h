@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <istream>
+#include <ostream>
+
+#include "Schedule.h"
+
+struct ICalendarStats
+{
+	size_t events = 0;
+	size_t skipped = 0;
+	size_t unknownZones = 0; // Of the skipped events
+	size_t bytes = 0;
+	std::chrono::nanoseconds elapsed{};
+};
+
+// Streams VEVENTs out of a calendar and folds every occurrence onto the week,
+// on the wall clock of zone. Only the current line and event are held in memory,
+// so the cost does not grow with the number of events.
+// DAILY rules cover every day of their BYDAY list (all seven without one),
+// WEEKLY rules cover their BYDAY list; any other event, one-off events from
+// any date included, covers the weekday it starts on.
+// A TZID the zone database does not know is read from the calendar's own
+// VTIMEZONE; events in a zone that is neither are skipped and counted.
+ICalendarStats ImportICalendar(std::istream& in, WeekIndex& week, const std::chrono::time_zone* zone);
+
+// weekCount == 0 writes one weekly recurring event per window, otherwise
+// every window in weekCount weeks starting at firstSunday is written out.
+// Times carry a TZID, and the calendar its VTIMEZONE, when zone is given and
+// are floating otherwise.
+void ExportICalendar(std::ostream& out, const WeekIndex& week, std::chrono::local_days firstSunday, int weekCount, const std::chrono::time_zone* zone = nullptr);
+
+// Writes a calendar of events for benchmarking the importer: a seeded mix of
+// UTC, floating, all-day and zoned times, including a Windows zone name with
+// its VTIMEZONE, with daily, weekly and monthly rules, cancelled events and
+// folded lines.
+void GenerateICalendar(std::ostream& out, size_t events, unsigned seed);
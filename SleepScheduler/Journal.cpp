@@ -0,0 +1,168 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <windows.h>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include "Journal.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	uint64_t Checksum(const JournalRecord& r)
+	{
+		return Fnv1a(&r, offsetof(JournalRecord, checksum));
+	}
+
+	void Apply(JournalState& state, const JournalRecord& r)
+	{
+		state.records++;
+		state.lastSeen = r.time;
+		state.hash = r.hash;
+
+		switch (r.kind)
+		{
+		case JournalKind::Window: state.windowStart = r.a; state.windowEnd = r.b; break;
+		case JournalKind::Suspend: state.lastSuspend = r.a; break;
+		case JournalKind::Trigger: state.trigger = r.a; state.triggerHash = r.hash; break;
+		default: break;
+		}
+	}
+
+	JournalRecord MakeRecord(JournalKind kind, int64_t time, uint64_t hash, int64_t a, int64_t b)
+	{
+		JournalRecord r = {};
+		r.magic = journalMagic;
+		r.kind = kind;
+		r.time = time;
+		r.a = a;
+		r.b = b;
+		r.hash = hash;
+		r.checksum = Checksum(r);
+		return r;
+	}
+
+	bool WriteAll(HANDLE file, const void* data, DWORD size)
+	{
+		DWORD written;
+		return WriteFile(file, data, size, &written, NULL) && written == size;
+	}
+}
+
+Journal::Journal(const char* _path) : path(_path != nullptr ? _path : "")
+{
+	file = INVALID_HANDLE_VALUE;
+	if (_path == nullptr) return;
+
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+
+	Replay();
+	if (state.records > compactAfter) Compact();
+}
+
+Journal::~Journal()
+{
+	if (!IsOpen()) return;
+
+	Flush();
+	CloseHandle(file);
+}
+
+bool Journal::IsOpen() const
+{
+	return file != INVALID_HANDLE_VALUE;
+}
+
+void Journal::Replay()
+{
+	JournalRecord batch[256];
+	LARGE_INTEGER valid = {};
+	DWORD read;
+	bool torn = false;
+
+	while (!torn && ReadFile(file, batch, sizeof(batch), &read, NULL) && read > 0)
+	{
+		size_t n = read / sizeof(JournalRecord);
+		for (size_t i = 0; i < n; i++)
+		{
+			// Anything after the first bad record was never committed
+			torn = batch[i].magic != journalMagic || batch[i].checksum != Checksum(batch[i]);
+			if (torn) break;
+
+			Apply(state, batch[i]);
+			valid.QuadPart += sizeof(JournalRecord);
+		}
+		if (n * sizeof(JournalRecord) != read) break;
+	}
+
+	// Drop a torn tail so new records start on a record boundary
+	SetFilePointerEx(file, valid, NULL, FILE_BEGIN);
+	SetEndOfFile(file);
+}
+
+void Journal::Compact()
+{
+	// One record per kind is enough to rebuild the state
+	vector<JournalRecord> records;
+	records.push_back(MakeRecord(JournalKind::Schedule, state.lastSeen, state.hash, 0, 0));
+	if (state.windowEnd != 0) records.push_back(MakeRecord(JournalKind::Window, state.lastSeen, state.hash, state.windowStart, state.windowEnd));
+	if (state.lastSuspend != 0) records.push_back(MakeRecord(JournalKind::Suspend, state.lastSeen, state.hash, state.lastSuspend, 0));
+	if (state.trigger != 0) records.push_back(MakeRecord(JournalKind::Trigger, state.lastSeen, state.triggerHash, state.trigger, 0));
+	// The trigger may have come from an older schedule, end on the current one
+	if (state.triggerHash != state.hash) records.push_back(MakeRecord(JournalKind::Schedule, state.lastSeen, state.hash, 0, 0));
+
+	string temp = path + ".tmp";
+	HANDLE out = CreateFileA(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (out == INVALID_HANDLE_VALUE) return;
+
+	bool ok = WriteAll(out, records.data(), (DWORD)(records.size() * sizeof(JournalRecord))) && FlushFileBuffers(out);
+	CloseHandle(out);
+	if (!ok) return;
+
+	// Only replace the journal once the compacted copy is on disk
+	CloseHandle(file);
+	if (!MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		DeleteFileA(temp.c_str());
+	}
+
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+
+	state = JournalState();
+	Replay();
+}
+
+void Journal::Append(JournalKind kind, uint64_t hash, int64_t a, int64_t b)
+{
+	if (!IsOpen()) return;
+
+	int64_t now = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+	JournalRecord r = MakeRecord(kind, now, hash, a, b);
+
+	// Only the latest suspend matters, so back-to-back ones share a slot
+	if (kind == JournalKind::Suspend && pendingCount > 0 && pending[pendingCount - 1].kind == JournalKind::Suspend)
+	{
+		pending[pendingCount - 1] = r;
+		state.records--;
+	}
+	else
+	{
+		if (pendingCount == batchSize) Flush();
+		pending[pendingCount++] = r;
+	}
+	Apply(state, r);
+}
+
+bool Journal::Flush()
+{
+	if (!IsOpen() || pendingCount == 0) return true;
+
+	bool ok = WriteAll(file, pending, (DWORD)(pendingCount * sizeof(JournalRecord))) && FlushFileBuffers(file);
+	pendingCount = 0;
+	return ok;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "Schedule.h"
+
+// Append-only record of what the scheduler decided, so a restarted process
+// can pick up where the last one stopped instead of starting from scratch.
+// Records have a fixed size and carry their own checksum, so a write torn by
+// a crash or power loss is detected and dropped on the next load.
+enum class JournalKind : uint8_t
+{
+	Schedule = 1, // A new schedule was loaded
+	Window = 2,   // a = start, b = end of the window the machine is in
+	Suspend = 3,  // a = suspend time
+	Trigger = 4,  // a = trigger registered with the Task Scheduler
+	Missed = 5    // a = start, b = end of a window that passed while not running
+};
+
+// All times are Unix seconds (UTC). hash identifies the schedule the record
+// was computed from.
+#pragma pack(push, 1)
+struct JournalRecord
+{
+	uint32_t magic;
+	JournalKind kind;
+	uint8_t reserved[3];
+	int64_t time; // When the record was written
+	int64_t a;
+	int64_t b;
+	uint64_t hash;
+	uint64_t checksum; // FNV-1a over the bytes before it
+};
+#pragma pack(pop)
+
+static_assert(sizeof(JournalRecord) == 48);
+
+constexpr uint32_t journalMagic = 0x314A5353; // "SSJ1"
+constexpr char journalName[] = "schedule.journal";
+
+// The latest value of every record kind, as replayed from the file.
+struct JournalState
+{
+	size_t records = 0;
+	int64_t lastSeen = 0; // Time of the newest record
+	uint64_t hash = 0;    // Schedule of the newest record
+	int64_t windowStart = 0;
+	int64_t windowEnd = 0;
+	int64_t lastSuspend = 0;
+	int64_t trigger = 0;
+	uint64_t triggerHash = 0;
+};
+
+// Appends are collected in memory and only written by Flush, or once a
+// batch is full. Consecutive Suspend records collapse into one, so a loop
+// that flushes once per window never fills a batch in between. Only one
+// thread may use a journal.
+// If the file cannot be opened, or no path is given, every call is a no-op:
+// the scheduler works as before, it just cannot resume.
+class Journal
+{
+private:
+	static constexpr size_t batchSize = 16;
+	// Older records are folded into the state on load once the file has this many
+	static constexpr size_t compactAfter = 4096;
+
+	std::string path;
+	void* file;
+	JournalRecord pending[batchSize];
+	size_t pendingCount = 0;
+
+	void Replay();
+	void Compact();
+
+public:
+	JournalState state;
+
+	Journal(const char* _path = journalName);
+	~Journal();
+
+	bool IsOpen() const;
+
+	void Append(JournalKind kind, uint64_t hash, int64_t a = 0, int64_t b = 0);
+
+	// Writes every pending record through to disk. Returns false on a write error.
+	bool Flush();
+};
@@ -0,0 +1,230 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <chrono>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "PowerBackend.h"
+
+using namespace std;
+using namespace std::chrono;
+
+#ifdef __linux__
+void LinuxBackend::AcquirePrivilege()
+{
+	// Writing the power state and arming alarm timers both need root (or
+	// CAP_WAKE_ALARM and write access to the file)
+	if (access("/sys/power/state", W_OK) != 0) throw runtime_error("No write access to /sys/power/state.");
+}
+
+void LinuxBackend::Suspend(system_clock::time_point wakeAt)
+{
+	int timer = -1;
+	if (wakeAt != noWake)
+	{
+		// An armed alarm timer wakes the machine, it does not need to be read
+		timer = timerfd_create(CLOCK_REALTIME_ALARM, TFD_CLOEXEC);
+		if (timer >= 0)
+		{
+			nanoseconds since = wakeAt.time_since_epoch();
+			itimerspec spec = {};
+			spec.it_value.tv_sec = (time_t)duration_cast<seconds>(since).count();
+			spec.it_value.tv_nsec = (long)(since % seconds{ 1 }).count();
+			timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+		}
+	}
+
+	// The write returns once the machine has resumed
+	int state = open("/sys/power/state", O_WRONLY | O_CLOEXEC);
+	if (state >= 0)
+	{
+		// On failure the caller checks the schedule again either way
+		ssize_t written = write(state, "mem", 3);
+		(void)written;
+		close(state);
+	}
+
+	if (timer >= 0) close(timer);
+}
+
+namespace
+{
+	// Names the relauncher, so a pid that has since been reused, or a
+	// relauncher that already became the scheduler, is never stopped
+	constexpr char relauncherName[] = "sleep-relaunch";
+
+	// Only async-signal-safe calls: the relauncher is forked from a process
+	// with other threads running
+	pid_t ReadPid(const char* path)
+	{
+		int file = open(path, O_RDONLY | O_CLOEXEC);
+		if (file < 0) return -1;
+
+		char buffer[16];
+		ssize_t n = read(file, buffer, sizeof(buffer));
+		close(file);
+
+		pid_t pid = 0;
+		for (ssize_t i = 0; i < n && buffer[i] >= '0' && buffer[i] <= '9'; i++) pid = pid * 10 + (buffer[i] - '0');
+		return pid > 0 ? pid : -1;
+	}
+
+	// Runs already named, so its pid is never on file under another name
+	[[noreturn]] void Relaunch(int gate, timespec when, const char* execPath, const char* pidPath)
+	{
+		setsid();
+
+		// Nothing inherited stays open for the days this may wait, the
+		// journal and the caller's terminal or pipes included; the gate
+		// moves to fd 3 first
+		if (gate != 3) dup2(gate, 3);
+		int null = open("/dev/null", O_RDWR);
+		for (int fd = 0; null >= 0 && fd < 3; fd++)
+		{
+			if (fd != null) dup2(null, fd);
+		}
+		close_range(4, ~0u, 0);
+
+		// Returns at end of file, once the parent has recorded this pid
+		char c;
+		while (read(3, &c, 1) < 0 && errno == EINTR);
+		close(3);
+
+		while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &when, NULL) == EINTR);
+
+		// A later registration took over
+		if (ReadPid(pidPath) != getpid()) _exit(0);
+
+		execl(execPath, execPath, (char*)NULL);
+		_exit(127);
+	}
+}
+
+bool LinuxBackend::RelaunchAt(sys_seconds at, bool /*onLogon*/)
+{
+	timespec when = {};
+	when.tv_sec = (time_t)at.time_since_epoch().count();
+
+	CancelPending();
+
+	// gate holds the relauncher back until its pid is on file, report
+	// carries that pid back from the intermediate child
+	int gate[2], report[2];
+	if (pipe2(gate, O_CLOEXEC) != 0) return false;
+	if (pipe2(report, O_CLOEXEC) != 0)
+	{
+		close(gate[0]);
+		close(gate[1]);
+		return false;
+	}
+
+	// Forked twice, so the relauncher belongs to init and never has to be
+	// reaped by this process, which may exit long before it does
+	const char* exec = execPath.c_str();
+	const char* pidFile = pidPath.c_str();
+	pid_t middle = fork();
+	if (middle == 0)
+	{
+		// Named before the second fork, so the relauncher has its name from
+		// the start and Pending never sees it under the scheduler's
+		prctl(PR_SET_NAME, relauncherName, 0, 0, 0);
+		pid_t relauncher = fork();
+		if (relauncher == 0) Relaunch(gate[0], when, exec, pidFile);
+
+		ssize_t written = write(report[1], &relauncher, sizeof(relauncher));
+		(void)written;
+		_exit(0);
+	}
+
+	close(gate[0]);
+	close(report[1]);
+
+	pid_t pid = -1;
+	ssize_t n = -1;
+	if (middle > 0)
+	{
+		while ((n = read(report[0], &pid, sizeof(pid))) < 0 && errno == EINTR);
+		while (waitpid(middle, NULL, 0) < 0 && errno == EINTR);
+	}
+	close(report[0]);
+
+	bool ok = n == sizeof(pid) && pid > 0;
+	if (ok)
+	{
+		string text = to_string(pid);
+		int file = open(pidFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		ok = file >= 0 && write(file, text.data(), text.size()) == (ssize_t)text.size();
+		if (file >= 0) close(file);
+	}
+
+	// Released either way; without its pid on file the relauncher just exits
+	close(gate[1]);
+	return ok;
+}
+
+int LinuxBackend::Pending() const
+{
+	pid_t pid = ReadPid(pidPath.c_str());
+	return pid > 0 && pid != getpid() && IsRelauncher(pid) ? pid : -1;
+}
+
+bool LinuxBackend::IsRelauncher(int pid)
+{
+	// /proc/<pid>/stat is "pid (name) state ...", a zombie is not waiting
+	string stat = "/proc/" + to_string(pid) + "/stat";
+	int file = open(stat.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file < 0) return false;
+
+	char buffer[256];
+	ssize_t n = read(file, buffer, sizeof(buffer) - 1);
+	close(file);
+	if (n <= 0) return false;
+	buffer[n] = '\0';
+
+	const char* name = strchr(buffer, '(');
+	const char* end = strrchr(buffer, ')');
+	if (name == NULL || end == NULL || end[1] != ' ' || end[2] == '\0') return false;
+
+	size_t length = strlen(relauncherName);
+	return (size_t)(end - name - 1) == length && strncmp(name + 1, relauncherName, length) == 0 && end[2] != 'Z';
+}
+
+void LinuxBackend::CancelPending()
+{
+	int pid = Pending();
+	if (pid > 0) kill(pid, SIGKILL);
+}
+#endif
+
+BackendTiming BenchmarkBackend(PowerBackend& backend, int iterations, bool suspend, bool relaunch)
+{
+	BackendTiming timing;
+	if (iterations <= 0) return timing;
+
+	auto measure = [&](auto call)
+	{
+		auto begin = steady_clock::now();
+		for (int i = 0; i < iterations; i++) call();
+		return duration<double, nano>(steady_clock::now() - begin).count() / iterations;
+	};
+
+	timing.privilege = measure([&]() { backend.AcquirePrivilege(); });
+	if (suspend) timing.suspend = measure([&]() { backend.Suspend(PowerBackend::noWake); });
+
+	// A time well past any real one, so a real registration would never fire
+	sys_seconds far = sys_days{ year{ 2100 } / 1 / 1 };
+	if (relaunch) timing.relaunch = measure([&]() { backend.RelaunchAt(far, false); });
+
+	return timing;
+}
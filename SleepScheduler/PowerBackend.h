@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <thread>
+
+// Everything the scheduler asks of the operating system. The decision logic
+// only talks to this, so it can run against the recording stand-in and each
+// implementation can be timed on its own.
+class PowerBackend
+{
+public:
+	// Pass to Suspend to sleep until something else wakes the machine
+	static constexpr std::chrono::system_clock::time_point noWake = std::chrono::system_clock::time_point::max();
+
+	virtual ~PowerBackend() {}
+
+	virtual const char* Name() const = 0;
+
+	// Gains the right to suspend the machine. Throws if it cannot.
+	virtual void AcquirePrivilege() = 0;
+
+	// Suspends the machine and returns once it runs again. A wake deadline
+	// wakes it at that time, where the platform has wake timers.
+	virtual void Suspend(std::chrono::system_clock::time_point wakeAt) = 0;
+
+	// Arranges for the program to be started again at a UTC instant, and at
+	// log-on if asked. Only the latest registration counts. The caller
+	// resolves the schedule's wall-clock time, so a backend only converts
+	// if its platform wants local times.
+	virtual bool RelaunchAt(std::chrono::sys_seconds at, bool onLogon) = 0;
+};
+
+// Records every call instead of acting on it. Calls go into a fixed ring, so
+// the stand-in never allocates and is safe on the allocation-checked path.
+// Suspend and RelaunchAt may be called from different threads.
+class RecordingBackend : public PowerBackend
+{
+public:
+	enum class CallKind { AcquirePrivilege, Suspend, RelaunchAt };
+
+	struct Call
+	{
+		CallKind kind;
+		std::chrono::system_clock::time_point wakeAt;
+		std::chrono::sys_seconds at;
+		bool onLogon;
+	};
+
+	static constexpr size_t capacity = 64;
+
+	// Total calls made; only the last capacity are kept
+	std::atomic<size_t> count = 0;
+	// What RelaunchAt reports back
+	bool relaunchResult = true;
+	// How long RelaunchAt stalls, to stand in for a slow Task Scheduler
+	std::chrono::milliseconds delay{ 0 };
+
+	const char* Name() const override { return "recording"; }
+
+	void AcquirePrivilege() override { Record({ CallKind::AcquirePrivilege, {}, {}, false }); }
+
+	void Suspend(std::chrono::system_clock::time_point wakeAt) override { Record({ CallKind::Suspend, wakeAt, {}, false }); }
+
+	bool RelaunchAt(std::chrono::sys_seconds at, bool onLogon) override
+	{
+		if (delay.count() > 0) std::this_thread::sleep_for(delay);
+		Record({ CallKind::RelaunchAt, {}, at, onLogon });
+		return relaunchResult;
+	}
+
+	// The i-th call ever made, for i within the last capacity calls
+	const Call& operator[](size_t i) const { return calls[i % capacity]; }
+
+private:
+	Call calls[capacity] = {};
+
+	void Record(const Call& call) { calls[count++ % capacity] = call; }
+};
+
+#ifdef __linux__
+// Suspends through /sys/power/state, waking on a CLOCK_REALTIME_ALARM timer,
+// and relaunches from a detached process that sleeps until the time with
+// clock_nanosleep. Log-on starts are left to the desktop's autostart.
+// The relauncher's pid is kept in a file next to the executable, so a
+// registration from any later run replaces it, and the relauncher itself
+// only execs if the file still names it when it wakes.
+class LinuxBackend : public PowerBackend
+{
+private:
+	std::string execPath;
+	std::string pidPath;
+
+public:
+	LinuxBackend(const std::string& _execPath) : execPath(_execPath), pidPath(_execPath + ".relaunch") {}
+
+	const char* Name() const override { return "linux"; }
+	void AcquirePrivilege() override;
+	void Suspend(std::chrono::system_clock::time_point wakeAt) override;
+	bool RelaunchAt(std::chrono::sys_seconds at, bool onLogon) override;
+
+	// Pid of the relauncher waiting from this or an earlier run, or -1
+	int Pending() const;
+
+	// True while pid is a relauncher that has not been stopped
+	static bool IsRelauncher(int pid);
+
+	// Stops the waiting relauncher, if there is one
+	void CancelPending();
+};
+#endif
+
+struct BackendTiming
+{
+	double privilege = 0; // Nanoseconds per call, 0 if not measured
+	double suspend = 0;
+	double relaunch = 0;
+};
+
+// Average cost of each call over iterations calls. Real backends suspend and
+// register for real, so only measure what is safe to repeat on them.
+BackendTiming BenchmarkBackend(PowerBackend& backend, int iterations, bool suspend, bool relaunch);
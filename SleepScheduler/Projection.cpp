@@ -0,0 +1,96 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <algorithm>
+
+#include "Projection.h"
+
+using namespace std;
+using namespace std::chrono;
+
+void ProjectionCache::Project(const WeekIndex& source, const time_zone* from, const time_zone* to, local_days week, WeekIndex& out)
+{
+	out = WeekIndex();
+
+	const local_minutes weekEnd = local_minutes{ week + weeks{ 1 } };
+
+	// Both offsets are constant between transitions, so walk the week in
+	// segments and only ask the zone database once per segment
+	for (local_minutes m = local_minutes{ week }; m < weekEnd;)
+	{
+		sys_seconds at = to->to_sys(m, choose::earliest);
+		sys_info localInfo = to->get_info(at);
+		sys_info sourceInfo = from->get_info(at);
+
+		local_minutes segmentEnd = weekEnd;
+		sys_seconds change = min(localInfo.end, sourceInfo.end);
+		if (change < sys_seconds{ local_seconds{ weekEnd }.time_since_epoch() - localInfo.offset })
+		{
+			segmentEnd = min(weekEnd, max(m + minutes{ 1 }, ceil<minutes>(local_seconds{ (change + localInfo.offset).time_since_epoch() })));
+		}
+
+		// The same instant on the source zone's wall clock
+		minutes shift = duration_cast<minutes>(sourceInfo.offset - localInfo.offset);
+		for (; m < segmentEnd; m += minutes{ 1 })
+		{
+			local_minutes s = m + shift;
+			local_days d = floor<days>(s);
+			int32_t sourceMinute = weekday{ d }.c_encoding() * WeekIndex::minutesPerDay + (int32_t)(s - d).count();
+
+			if (source.Test(sourceMinute))
+			{
+				int32_t localMinute = (int32_t)(m - local_minutes{ week }).count();
+				out.bits[localMinute >> 6] |= 1ull << (localMinute & 63);
+			}
+		}
+	}
+
+	out.Compile();
+}
+
+const WeekIndex& ProjectionCache::Get(const WeekIndex& source, const time_zone* zone, local_days weekStart)
+{
+	tick++;
+
+	for (auto& e : entries)
+	{
+		if (e->zone == zone && e->week == weekStart)
+		{
+			hits++;
+			e->lastUse = tick;
+			return e->index;
+		}
+	}
+
+	misses++;
+
+	Entry* slot;
+	if (entries.size() < capacity)
+	{
+		slot = entries.emplace_back(make_unique<Entry>()).get();
+	}
+	else
+	{
+		slot = min_element(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a->lastUse < b->lastUse; })->get();
+	}
+
+	slot->zone = zone;
+	slot->week = weekStart;
+	slot->lastUse = tick;
+	Project(source, zone, local, weekStart, slot->index);
+	return slot->index;
+}
+
+void ProjectionCache::Clear()
+{
+	entries.clear();
+}
+
+size_t ProjectionCache::MemoryBytes() const
+{
+	size_t bytes = sizeof(*this) + entries.capacity() * sizeof(entries[0]);
+	for (const auto& e : entries)
+	{
+		bytes += sizeof(Entry) + e->index.windows.capacity() * sizeof(MinuteWindow);
+	}
+	return bytes;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "Schedule.h"
+
+// Projects a week declared in another time zone onto the local wall clock.
+// The offset between two zones changes from week to week around DST, so each
+// projected week is cached by (zone, local week) and reused on every check.
+class ProjectionCache
+{
+private:
+	struct Entry
+	{
+		const std::chrono::time_zone* zone = nullptr;
+		std::chrono::local_days week;
+		size_t lastUse = 0;
+		WeekIndex index;
+	};
+
+	const std::chrono::time_zone* local;
+	size_t capacity;
+	size_t tick = 0;
+	std::vector<std::unique_ptr<Entry>> entries;
+
+	static void Project(const WeekIndex& source, const std::chrono::time_zone* from, const std::chrono::time_zone* to, std::chrono::local_days week, WeekIndex& out);
+
+public:
+	size_t hits = 0;
+	size_t misses = 0;
+
+	ProjectionCache(const std::chrono::time_zone* _local, size_t _capacity = 4) : local(_local), capacity(_capacity) {}
+
+	// The source week as seen from the local zone during the local week that
+	// starts on weekStart (a Sunday). The reference stays valid until the
+	// entry is evicted, which takes capacity further distinct weeks.
+	const WeekIndex& Get(const WeekIndex& source, const std::chrono::time_zone* zone, std::chrono::local_days weekStart);
+
+	// Must be called whenever the source week changes.
+	void Clear();
+
+	size_t MemoryBytes() const;
+};
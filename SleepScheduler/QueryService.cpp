@@ -0,0 +1,294 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <vector>
+
+#include "QueryService.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+using namespace std;
+
+namespace
+{
+	using namespace std::chrono;
+
+	// Local wall-clock minutes since the epoch; the index is in local time.
+	int64_t ToLocalMinutes(const time_zone* zone, int64_t unixSeconds)
+	{
+		local_seconds lt = zone->to_local(sys_seconds{ seconds{ unixSeconds } });
+		return floor<minutes>(lt).time_since_epoch().count();
+	}
+
+	int64_t ToUnixSeconds(const time_zone* zone, int64_t localMinutes)
+	{
+		sys_seconds st = zone->to_sys(local_seconds{ minutes{ localMinutes } }, choose::earliest);
+		return st.time_since_epoch().count();
+	}
+
+	// Local minute of the Sunday 00:00 that starts the week containing localMinutes.
+	int64_t WeekStart(int64_t localMinutes)
+	{
+		local_days d = floor<days>(local_minutes{ minutes{ localMinutes } });
+		d -= days{ weekday{ d }.c_encoding() };
+		return duration_cast<minutes>(d.time_since_epoch()).count();
+	}
+
+	struct Client
+	{
+		SOCKET socket = INVALID_SOCKET;
+		size_t inUsed = 0;
+		char in[sizeof(QueryRequest) * 64];
+		vector<char> out;
+		size_t outSent = 0;
+		// The client shut down its side; answers still go out before closing
+		bool readDone = false;
+	};
+
+	constexpr size_t maxResponseSize = sizeof(QueryResponse) + maxRangeWindows * sizeof(QueryWindow);
+	constexpr size_t maxPendingOutput = 64 * 1024;
+}
+
+size_t QueryService::Answer(const QueryRequest& req, char* out, size_t outSize) const
+{
+	QueryResponse res{ (uint32_t)QueryStatus::Ok, 0, 0, 0 };
+	size_t written = sizeof(res);
+
+	if (outSize < maxResponseSize)
+	{
+		res.status = (uint32_t)QueryStatus::BadRequest;
+		memcpy(out, &res, sizeof(res));
+		return written;
+	}
+
+	// A request that cannot be converted fails on its own, never the service
+	try
+	{
+		if (req.a < minQueryTime || req.a > maxQueryTime) throw out_of_range("Time out of range.");
+
+		switch ((QueryOp)req.op)
+		{
+		case QueryOp::IsAsleepAt:
+		case QueryOp::NextWindow:
+		{
+			int64_t now = ToLocalMinutes(zone, req.a);
+			int64_t week = WeekStart(now);
+			MinuteWindow w;
+
+			const MinuteWindow* found = index.Containing((int32_t)(now - week), w);
+			if (found == nullptr && (QueryOp)req.op == QueryOp::NextWindow)
+			{
+				found = index.Next((int32_t)(now - week), w);
+			}
+
+			if (found == nullptr)
+			{
+				res.status = (uint32_t)QueryStatus::NotFound;
+				break;
+			}
+
+			res.count = 1;
+			res.start = ToUnixSeconds(zone, week + w.start);
+			res.end = ToUnixSeconds(zone, week + w.end);
+			break;
+		}
+
+		case QueryOp::WindowsInRange:
+		{
+			if (req.b < req.a || req.b > maxQueryTime || req.b - req.a > maxRangeSeconds)
+			{
+				res.status = (uint32_t)QueryStatus::BadRequest;
+				break;
+			}
+
+			int64_t from = ToLocalMinutes(zone, req.a);
+			int64_t to = ToLocalMinutes(zone, req.b);
+			char* records = out + sizeof(res);
+
+			// Start a week early to catch a window wrapping in from the previous week
+			for (int64_t week = WeekStart(from) - WeekIndex::minutesPerWeek; week < to && res.status == (uint32_t)QueryStatus::Ok; week += WeekIndex::minutesPerWeek)
+			{
+				for (const MinuteWindow& w : index.windows)
+				{
+					if (week + w.end <= from) continue;
+					if (week + w.start >= to) break;
+
+					if (res.count == maxRangeWindows)
+					{
+						res.status = (uint32_t)QueryStatus::Truncated;
+						break;
+					}
+
+					QueryWindow qw{ ToUnixSeconds(zone, week + w.start), ToUnixSeconds(zone, week + w.end) };
+					memcpy(records + res.count * sizeof(qw), &qw, sizeof(qw));
+					res.count++;
+				}
+			}
+
+			written += res.count * sizeof(QueryWindow);
+			break;
+		}
+
+		default:
+			res.status = (uint32_t)QueryStatus::BadRequest;
+			break;
+		}
+	}
+	catch (const std::exception&)
+	{
+		res = { (uint32_t)QueryStatus::BadRequest, 0, 0, 0 };
+		written = sizeof(res);
+	}
+
+	memcpy(out, &res, sizeof(res));
+	return written;
+}
+
+void QueryService::Run()
+{
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) throw exception("WSAStartup failed");
+
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (WideCharToMultiByte(CP_UTF8, 0, socketPath.c_str(), -1, addr.sun_path, sizeof(addr.sun_path), NULL, NULL) == 0)
+	{
+		WSACleanup();
+		throw exception("Socket path too long.");
+	}
+
+	SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET)
+	{
+		WSACleanup();
+		throw exception(format("Cannot create socket: {}", WSAGetLastError()).c_str());
+	}
+
+	DeleteFile(socketPath.c_str());
+
+	u_long nonBlocking = 1;
+	if (bind(listener, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		listen(listener, SOMAXCONN) == SOCKET_ERROR ||
+		ioctlsocket(listener, FIONBIO, &nonBlocking) == SOCKET_ERROR)
+	{
+		int error = WSAGetLastError();
+		closesocket(listener);
+		WSACleanup();
+		throw exception(format("Cannot listen on {}: {}", addr.sun_path, error).c_str());
+	}
+
+	// fds[0] is the listener, fds[i] belongs to clients[i - 1]
+	vector<WSAPOLLFD> fds{ { listener, POLLRDNORM, 0 } };
+	vector<Client> clients;
+	// Responses are built here and only the bytes written are queued, most
+	// answers are a bare header
+	vector<char> scratch(maxResponseSize);
+
+	while (true)
+	{
+		if (WSAPoll(fds.data(), (ULONG)fds.size(), -1) == SOCKET_ERROR)
+		{
+			int error = WSAGetLastError();
+			for (Client& c : clients) closesocket(c.socket);
+			closesocket(listener);
+			WSACleanup();
+			throw exception(format("WSAPoll failed: {}", error).c_str());
+		}
+
+		if (fds[0].revents & POLLRDNORM)
+		{
+			SOCKET s;
+			while ((s = accept(listener, NULL, NULL)) != INVALID_SOCKET)
+			{
+				ioctlsocket(s, FIONBIO, &nonBlocking);
+				fds.push_back({ s, POLLRDNORM, 0 });
+				clients.emplace_back().socket = s;
+			}
+		}
+
+		for (size_t i = fds.size(); i-- > 1;)
+		{
+			Client& c = clients[i - 1];
+			bool closed = (fds[i].revents & (POLLERR | POLLNVAL)) != 0;
+
+			if (!closed && !c.readDone && (fds[i].revents & (POLLRDNORM | POLLHUP)) && c.inUsed < sizeof(c.in))
+			{
+				int n = recv(c.socket, c.in + c.inUsed, (int)(sizeof(c.in) - c.inUsed), 0);
+				if (n == 0)
+				{
+					c.readDone = true;
+				}
+				else if (n == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+				{
+					closed = true;
+				}
+				else if (n > 0)
+				{
+					c.inUsed += n;
+				}
+			}
+
+			// Requests past the output limit wait in c.in until the client reads
+			size_t consumed = 0;
+			for (; !closed && c.inUsed - consumed >= sizeof(QueryRequest) && c.out.size() - c.outSent < maxPendingOutput; consumed += sizeof(QueryRequest))
+			{
+				QueryRequest req;
+				memcpy(&req, c.in + consumed, sizeof(req));
+
+				size_t written = Answer(req, scratch.data(), scratch.size());
+				c.out.insert(c.out.end(), scratch.data(), scratch.data() + written);
+			}
+
+			memmove(c.in, c.in + consumed, c.inUsed - consumed);
+			c.inUsed -= consumed;
+
+			if (!closed && c.outSent < c.out.size())
+			{
+				int n = send(c.socket, c.out.data() + c.outSent, (int)(c.out.size() - c.outSent), 0);
+				if (n == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+				{
+					closed = true;
+				}
+				else if (n > 0)
+				{
+					c.outSent += n;
+					if (c.outSent == c.out.size())
+					{
+						c.out.clear();
+						c.outSent = 0;
+					}
+				}
+			}
+
+			// A trailing partial request after end of file is never completed
+			if (c.readDone && c.out.size() == c.outSent && c.inUsed < sizeof(QueryRequest)) closed = true;
+
+			if (closed)
+			{
+				closesocket(c.socket);
+				if (i != fds.size() - 1)
+				{
+					fds[i] = fds.back();
+					clients[i - 1] = move(clients.back());
+				}
+				fds.pop_back();
+				clients.pop_back();
+				continue;
+			}
+
+			// Stop reading from clients that are not draining their responses.
+			// Requests held back are answered on the next writable wakeup.
+			size_t pending = c.out.size() - c.outSent;
+			bool held = c.inUsed >= sizeof(QueryRequest);
+			bool reading = !c.readDone && pending < maxPendingOutput && c.inUsed < sizeof(c.in);
+			fds[i].events = (SHORT)((reading ? POLLRDNORM : 0) | (pending > 0 || held ? POLLWRNORM : 0));
+			fds[i].revents = 0;
+		}
+	}
+}
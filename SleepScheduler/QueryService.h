@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "Schedule.h"
+
+// Binary protocol spoken over the local socket. All fields are little-endian,
+// times are Unix seconds (UTC). A client may pipeline any number of requests
+// on one connection; responses come back in the same order. Shutting down the
+// sending side after the last request still gets every response.
+enum class QueryOp : uint32_t
+{
+	IsAsleepAt = 1,    // a = t
+	NextWindow = 2,    // a = t
+	WindowsInRange = 3 // a = range start, b = range end
+};
+
+enum class QueryStatus : uint32_t
+{
+	Ok = 0,
+	NotFound = 1,  // Empty schedule / not asleep
+	Truncated = 2, // WindowsInRange hit maxRangeWindows
+	BadRequest = 3 // Unknown op, time out of range or range too long
+};
+
+#pragma pack(push, 1)
+struct QueryRequest
+{
+	uint32_t op;
+	uint32_t reserved;
+	int64_t a;
+	int64_t b;
+};
+
+// For IsAsleepAt and NextWindow, start/end describe the window.
+// For WindowsInRange, count QueryWindow records follow the header.
+struct QueryResponse
+{
+	uint32_t status;
+	uint32_t count;
+	int64_t start;
+	int64_t end;
+};
+
+struct QueryWindow
+{
+	int64_t start;
+	int64_t end;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(QueryRequest) == 24);
+static_assert(sizeof(QueryResponse) == 24);
+
+constexpr uint32_t maxRangeWindows = 512;
+// Times outside 1970-01-01 to 9999-12-31 are rejected, so converting them
+// never overflows, and a range may span at most 53 weeks
+constexpr int64_t minQueryTime = 0;
+constexpr int64_t maxQueryTime = 253402300799;
+constexpr int64_t maxRangeSeconds = 53 * 7 * 86400ll;
+constexpr wchar_t querySocketName[] = L"sleepscheduler.sock";
+
+// Serves queries against a compiled week from a single thread, multiplexing
+// every client with WSAPoll. The index is only read, never copied.
+class QueryService
+{
+private:
+	const WeekIndex& index;
+	// Zone the index is declared in; queries are converted into it directly
+	const std::chrono::time_zone* zone;
+	std::wstring socketPath;
+
+public:
+	QueryService(const WeekIndex& _index, const std::chrono::time_zone* _zone, const std::wstring& _socketPath) : index(_index), zone(_zone), socketPath(_socketPath) {}
+
+	// Blocks until the listening socket fails.
+	void Run();
+
+	// Answers a single request, appending the response to out. Returns the
+	// number of bytes written. Never throws: a request that cannot be
+	// answered gets BadRequest.
+	size_t Answer(const QueryRequest& req, char* out, size_t outSize) const;
+};
@@ -0,0 +1,409 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <string>
+#include <vector>
+
+struct DoubleTime
+{
+	int hour = 0;
+	int minute = 0;
+	// Only set by schedules written with seconds, see SecondIndex
+	int second = 0;
+
+	constexpr DoubleTime() : hour(0), minute(0), second(0) {}
+	constexpr DoubleTime(int _hour, int _minute, int _second = 0) : hour(_hour), minute(_minute), second(_second) {}
+
+	static constexpr DoubleTime from_seconds(int s)
+	{
+		int m = s >= 0 ? s / 60 : (s - 59) / 60;
+		int h = m >= 0 ? m / 60 : (m - 59) / 60;
+		return DoubleTime(h, m - h * 60, s - m * 60);
+	}
+
+	constexpr DoubleTime operator+ (const DoubleTime& t) const
+	{
+		return from_seconds(to_seconds() + t.to_seconds());
+	}
+	DoubleTime& operator+= (const DoubleTime& t)
+	{
+		return *this = *this + t;
+	}
+	constexpr DoubleTime operator- (const DoubleTime& t) const
+	{
+		return from_seconds(to_seconds() - t.to_seconds());
+	}
+	DoubleTime& operator-= (const DoubleTime& t)
+	{
+		return *this = *this - t;
+	}
+
+	constexpr bool operator== (const DoubleTime& t) const
+	{
+		return to_seconds() == t.to_seconds();
+	}
+	constexpr bool operator> (const DoubleTime& t) const
+	{
+		return to_seconds() > t.to_seconds();
+	}
+	constexpr bool operator>= (const DoubleTime& t) const
+	{
+		return to_seconds() >= t.to_seconds();
+	}
+	constexpr bool operator< (const DoubleTime& t) const
+	{
+		return to_seconds() < t.to_seconds();
+	}
+	constexpr bool operator<= (const DoubleTime& t) const
+	{
+		return to_seconds() <= t.to_seconds();
+	}
+
+	std::string to_string() const
+	{
+		if (second != 0) return std::format("{:02}:{:02}:{:02}", hour, minute, second);
+		return std::format("{:02}:{:02}", hour, minute);
+	}
+
+	constexpr unsigned int to_minutes() const
+	{
+		return hour * 60 + minute;
+	}
+
+	constexpr int to_seconds() const
+	{
+		return (hour * 60 + minute) * 60 + second;
+	}
+
+	static const DoubleTime one_day;
+	static const DoubleTime one_hour;
+	static const DoubleTime one_minute;
+	static const DoubleTime one_second;
+	static const DoubleTime zero;
+};
+inline const DoubleTime DoubleTime::one_day = DoubleTime(24, 0);
+inline const DoubleTime DoubleTime::one_hour = DoubleTime(1, 0);
+inline const DoubleTime DoubleTime::one_minute = DoubleTime(0, 1);
+inline const DoubleTime DoubleTime::one_second = DoubleTime(0, 0, 1);
+inline const DoubleTime DoubleTime::zero = DoubleTime(0, 0);
+
+struct TimeSpan
+{
+	DoubleTime start;
+	DoubleTime end;
+
+	// Ends are inclusive, so spans one step apart (a minute, or a second in
+	// second resolution schedules) are adjacent and merge
+	bool overlapping(const TimeSpan& t, const DoubleTime& step = DoubleTime::one_minute) const
+	{
+		if (t < *this) return t.overlapping(*this, step);
+		return end + step >= t.start;
+	}
+
+	bool operator== (const TimeSpan& t) const
+	{
+		return start == t.start;
+	}
+	bool operator> (const TimeSpan& t) const
+	{
+		return start > t.start;
+	}
+	bool operator< (const TimeSpan& t) const
+	{
+		return start < t.start;
+	}
+
+	bool contains(const DoubleTime& time) const
+	{
+		return time >= start && time <= end;
+	}
+
+	template<class T>
+	bool contains(const std::chrono::hh_mm_ss<T>& time) const
+	{
+		DoubleTime t( time.hours().count(), time.minutes().count() );
+		return contains(t);
+	}
+
+	std::string to_string() const
+	{
+		return std::format("{}-{}", start.to_string(), end.to_string());
+	}
+
+	DoubleTime length() const
+	{
+		return end - start;
+	}
+};
+
+// Half-open range of minutes, counted from Sunday 00:00 of some week.
+// end may run past minutesPerWeek when a window wraps into the next week.
+struct MinuteWindow
+{
+	int32_t start = 0;
+	int32_t end = 0;
+
+	constexpr bool contains(int32_t minute) const
+	{
+		return minute >= start && minute < end;
+	}
+};
+
+// Compiled form of a merged week: one bit per minute, plus the same data as a
+// sorted list of windows so that next/range queries are a binary search.
+struct WeekIndex
+{
+	static constexpr int32_t minutesPerDay = 24 * 60;
+	static constexpr int32_t minutesPerWeek = 7 * minutesPerDay;
+	static constexpr size_t wordCount = (minutesPerWeek + 63) / 64;
+
+	uint64_t bits[wordCount] = {};
+	// Sorted by start. If the week wraps (asleep at both Saturday 23:59 and
+	// Sunday 00:00) the last window absorbs the first and ends past the week.
+	std::vector<MinuteWindow> windows;
+
+	void Build(const std::vector<TimeSpan> (&spans)[7])
+	{
+		std::fill(std::begin(bits), std::end(bits), 0);
+
+		for (int d = 0; d < 7; d++)
+		{
+			for (const TimeSpan& ts : spans[d])
+			{
+				// Span ends are inclusive minutes
+				SetRange(d * minutesPerDay + (int32_t)ts.start.to_minutes(), d * minutesPerDay + (int32_t)ts.end.to_minutes());
+			}
+		}
+
+		Compile();
+	}
+
+	// Marks minutes first..last (inclusive) as asleep, wrapping past Saturday
+	// into Sunday. Overlapping and adjacent ranges merge for free.
+	void SetRange(int32_t first, int32_t last)
+	{
+		if (last - first + 1 >= minutesPerWeek)
+		{
+			std::fill(std::begin(bits), std::end(bits), ~0ull);
+			bits[wordCount - 1] &= (1ull << (minutesPerWeek & 63)) - 1;
+			return;
+		}
+
+		int32_t n = last - first + 1;
+		for (int32_t m = ((first % minutesPerWeek) + minutesPerWeek) % minutesPerWeek; n > 0; n--, m = m + 1 == minutesPerWeek ? 0 : m + 1)
+		{
+			bits[m >> 6] |= 1ull << (m & 63);
+		}
+	}
+
+	// Rebuilds the window list from the bitmap.
+	void Compile()
+	{
+		windows.clear();
+		for (int32_t m = 0; m < minutesPerWeek;)
+		{
+			if (!Test(m)) { m++; continue; }
+			MinuteWindow w{ m, m };
+			while (w.end < minutesPerWeek && Test(w.end)) w.end++;
+			windows.push_back(w);
+			m = w.end;
+		}
+
+		if (windows.size() > 1 && windows.front().start == 0 && windows.back().end == minutesPerWeek)
+		{
+			windows.back().end += windows.front().end;
+			windows.erase(windows.begin());
+		}
+	}
+
+	// Splits the bitmap back into per-day spans with inclusive ends, the same
+	// shape ParseFile produces after splitting at midnight and merging.
+	void ToSpans(std::vector<TimeSpan> (&spans)[7]) const
+	{
+		for (int d = 0; d < 7; d++)
+		{
+			spans[d].clear();
+			for (int32_t m = d * minutesPerDay, dayEnd = m + minutesPerDay; m < dayEnd;)
+			{
+				if (!Test(m)) { m++; continue; }
+				int32_t last = m;
+				while (last + 1 < dayEnd && Test(last + 1)) last++;
+				int32_t first = m - d * minutesPerDay, end = last - d * minutesPerDay;
+				spans[d].push_back(TimeSpan(DoubleTime(first / 60, first % 60), DoubleTime(end / 60, end % 60)));
+				m = last + 1;
+			}
+		}
+	}
+
+	bool Test(int32_t minuteOfWeek) const
+	{
+		return (bits[minuteOfWeek >> 6] >> (minuteOfWeek & 63)) & 1;
+	}
+
+	// Window containing the minute, in the same week frame as the argument
+	// (start may be negative when the window began in the previous week).
+	const MinuteWindow* Containing(int32_t minuteOfWeek, MinuteWindow& out) const
+	{
+		if (!Test(minuteOfWeek)) return nullptr;
+
+		auto it = std::upper_bound(windows.begin(), windows.end(), minuteOfWeek,
+			[](int32_t m, const MinuteWindow& w) { return m < w.start; });
+
+		if (it != windows.begin() && std::prev(it)->contains(minuteOfWeek))
+		{
+			out = *std::prev(it);
+		}
+		else
+		{
+			out = { windows.back().start - minutesPerWeek, windows.back().end - minutesPerWeek };
+		}
+		return &out;
+	}
+
+	// First window starting at or after the minute, possibly in the next week.
+	const MinuteWindow* Next(int32_t minuteOfWeek, MinuteWindow& out) const
+	{
+		if (windows.empty()) return nullptr;
+
+		auto it = std::lower_bound(windows.begin(), windows.end(), minuteOfWeek,
+			[](const MinuteWindow& w, int32_t m) { return w.start < m; });
+
+		if (it != windows.end())
+		{
+			out = *it;
+		}
+		else
+		{
+			out = { windows.front().start + minutesPerWeek, windows.front().end + minutesPerWeek };
+		}
+		return &out;
+	}
+
+	int32_t SleepMinutes() const
+	{
+		int32_t n = 0;
+		for (uint64_t w : bits) n += std::popcount(w);
+		return n;
+	}
+};
+
+// Same shape as MinuteWindow, counted in seconds from Sunday 00:00:00.
+using SecondWindow = MinuteWindow;
+
+// Second resolution form of a merged week. As a bitmap this would be 604,800
+// bits, but a schedule only has a handful of windows, so it keeps just those
+// (run-length form) and binary searches them.
+struct SecondIndex
+{
+	static constexpr int32_t secondsPerDay = 24 * 60 * 60;
+	static constexpr int32_t secondsPerWeek = 7 * secondsPerDay;
+
+	// Sorted and merged, wrapping the same way as WeekIndex::windows
+	std::vector<SecondWindow> windows;
+
+	void Build(const std::vector<TimeSpan> (&spans)[7])
+	{
+		windows.clear();
+
+		for (int d = 0; d < 7; d++)
+		{
+			for (const TimeSpan& ts : spans[d])
+			{
+				// Span ends are inclusive seconds
+				windows.push_back({ d * secondsPerDay + ts.start.to_seconds(), d * secondsPerDay + ts.end.to_seconds() + 1 });
+			}
+		}
+
+		std::sort(windows.begin(), windows.end(), [](const SecondWindow& a, const SecondWindow& b) { return a.start < b.start; });
+
+		size_t n = 0;
+		for (size_t i = 0; i < windows.size(); i++)
+		{
+			if (n > 0 && windows[n - 1].end >= windows[i].start) windows[n - 1].end = std::max(windows[n - 1].end, windows[i].end);
+			else windows[n++] = windows[i];
+		}
+		windows.resize(n);
+
+		if (windows.size() > 1 && windows.front().start == 0 && windows.back().end == secondsPerWeek)
+		{
+			windows.back().end += windows.front().end;
+			windows.erase(windows.begin());
+		}
+	}
+
+	// Window containing the second, in the same week frame as the argument.
+	const SecondWindow* Containing(int32_t secondOfWeek, SecondWindow& out) const
+	{
+		auto it = std::upper_bound(windows.begin(), windows.end(), secondOfWeek,
+			[](int32_t s, const SecondWindow& w) { return s < w.start; });
+
+		if (it != windows.begin() && std::prev(it)->contains(secondOfWeek))
+		{
+			out = *std::prev(it);
+			return &out;
+		}
+
+		if (!windows.empty() && windows.back().contains(secondOfWeek + secondsPerWeek))
+		{
+			out = { windows.back().start - secondsPerWeek, windows.back().end - secondsPerWeek };
+			return &out;
+		}
+
+		return nullptr;
+	}
+
+	bool Contains(int32_t secondOfWeek) const
+	{
+		SecondWindow w;
+		return Containing(secondOfWeek, w) != nullptr;
+	}
+
+	// First window starting at or after the second, possibly in the next week.
+	const SecondWindow* Next(int32_t secondOfWeek, SecondWindow& out) const
+	{
+		if (windows.empty()) return nullptr;
+
+		auto it = std::lower_bound(windows.begin(), windows.end(), secondOfWeek,
+			[](const SecondWindow& w, int32_t s) { return w.start < s; });
+
+		if (it != windows.end())
+		{
+			out = *it;
+		}
+		else
+		{
+			out = { windows.front().start + secondsPerWeek, windows.front().end + secondsPerWeek };
+		}
+		return &out;
+	}
+
+	// Next second at which being asleep or awake changes, or -1 if it never does.
+	int32_t NextBoundary(int32_t secondOfWeek) const
+	{
+		SecondWindow w;
+		if (Containing(secondOfWeek, w) != nullptr) return w.end - w.start >= secondsPerWeek ? -1 : w.end;
+		return Next(secondOfWeek, w) != nullptr ? w.start : -1;
+	}
+
+	size_t MemoryBytes() const
+	{
+		return sizeof(*this) + windows.capacity() * sizeof(SecondWindow);
+	}
+};
+
+// Content hash shared by the journal and the bundle
+constexpr uint64_t fnvOffset = 14695981039346656037ull;
+
+inline uint64_t Fnv1a(const void* data, size_t size, uint64_t hash = fnvOffset)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ p[i]) * 1099511628211ull;
+	}
+	return hash;
+}
@@ -0,0 +1,469 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <tuple>
+
+#include "Projection.h"
+#include "ScheduleFile.h"
+
+using namespace std;
+
+thread_local vector<TimeSpan> spans[7];
+thread_local WeekIndex weekIndex;
+thread_local bool secondResolution = false;
+thread_local SecondIndex secondIndex;
+thread_local int sleepInterval = 0;
+thread_local DoubleTime totalSleepTime;
+thread_local bool onLogon = false;
+thread_local const chrono::time_zone* scheduleZone = NULL;
+
+void CheckSleepTime()
+{
+	totalSleepTime = { 0, 0 };
+	const DoubleTime& step = secondResolution ? DoubleTime::one_second : DoubleTime::one_minute;
+
+	for (int i = 0; i < 7; i++)
+	{
+		for (size_t j = spans[i].size(); j--;)
+		{
+			totalSleepTime += spans[i][j].length() + step;
+		}
+	}
+
+	const int maxSleepTime = (7 * 24 - 1) * 60; // All week, except for one hour
+
+	if (totalSleepTime.to_seconds() > maxSleepTime * 60)
+	{
+		throw exception(format("Schedule file sleeps for too long! ({} day(s), {} hour(s), {} minute(s)).", totalSleepTime.hour / 24, totalSleepTime.hour % 24, totalSleepTime.minute).c_str());
+	}
+}
+
+void ParseSchedule(istream& in)
+{
+	for (int i = 0; i < 7; i++)
+	{
+		spans[i] = vector<TimeSpan>();
+	}
+
+	string line;
+	getline(in, line);
+	istringstream ss(line);
+
+	if (!(ss >> sleepInterval) || sleepInterval < 0) throw exception(format("Invalid restart interval ({}).", line).c_str());
+
+	getline(in, line);
+	onLogon = line == "true" || line == "True" || line == "TRUE";
+
+	secondResolution = false;
+	// Spans are split at midnight once the resolution of the whole file is
+	// known, each with whether its end was written with seconds
+	vector<tuple<int, TimeSpan, bool>> parsed;
+
+	for (int i = 0; i < 7; i++)
+	{
+		getline(in, line);
+		ss = istringstream(line);
+
+		if (ss.get() != '[')
+		{
+			throw exception(format("Schedule file improperly formatted (Line {}) (No opening bracket).", i + 1).c_str());
+		}
+		if (ss.peek() == ']') continue;
+
+		auto read = [&](int& value)
+		{
+			if (!(ss >> value)) throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
+		};
+
+		int next;
+		do
+		{
+			TimeSpan ts;
+			bool exactEnd = false;
+			read(ts.start.hour);
+			if (ss.get() != ':') throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
+			read(ts.start.minute);
+			if (ss.peek() == ':')
+			{
+				ss.get();
+				read(ts.start.second);
+				secondResolution = true;
+			}
+			if (ss.get() != '-') throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
+			read(ts.end.hour);
+			if (ss.get() != ':') throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
+			read(ts.end.minute);
+			if (ss.peek() == ':')
+			{
+				ss.get();
+				read(ts.end.second);
+				secondResolution = true;
+				exactEnd = true;
+			}
+
+			if(ts.start.hour < 0 || ts.start.minute < 0 || ts.start.second < 0 || ts.end.hour < 0 || ts.end.minute < 0 || ts.end.second < 0)
+				throw exception(format("Cannot have negative time (Line {}) ({}).", i + 1, ts.to_string()).c_str());
+
+			// Hours past midnight run into the next days, but not past the week
+			if (ts.start.hour >= 7 * 24 || ts.end.hour >= 7 * 24)
+				throw exception(format("Cannot have hours over a week (Line {}) ({}).", i + 1, ts.to_string()).c_str());
+
+			if (ts.start.minute >= 60 || ts.end.minute >= 60)
+				throw exception(format("Cannot have minutes over 60 (Line {}) ({}).", i + 1, ts.to_string()).c_str());
+
+			if (ts.start.second >= 60 || ts.end.second >= 60)
+				throw exception(format("Cannot have seconds over 60 (Line {}) ({}).", i + 1, ts.to_string()).c_str());
+
+			parsed.push_back({ i, ts, exactEnd });
+			next = ss.get();
+		}
+		while (next == ',');
+
+		if (next == EOF) throw exception(format("Schedule file improperly formatted (Line {}) (No closing bracket).", i + 1).c_str());
+		if (next != ']') throw exception(format("Invalid character (Line {}) ({}).", i + 1, (char)next).c_str());
+	}
+
+	const DoubleTime lastOfDay = secondResolution ? DoubleTime(23, 59, 59) : DoubleTime(23, 59);
+
+	for (auto& [i, ts, exactEnd] : parsed)
+	{
+		int _i = i;
+
+		// 8:00 as an end means through 8:00:59, whatever the resolution
+		if (secondResolution && !exactEnd) ts.end.second = 59;
+
+		// Hours are bounded above, so each of these loops runs at most a week's worth of days
+		while (ts.end < ts.start) ts.end.hour += 24;
+
+		while (ts.start.hour >= 24)
+		{
+			_i = (_i + 1) % 7;
+			ts.start.hour -= 24;
+			ts.end.hour -= 24;
+		}
+
+		while (ts.end.hour >= 24)
+		{
+			spans[_i].push_back(TimeSpan(ts.start, lastOfDay));
+			_i = (_i + 1) % 7;
+
+			ts.start = DoubleTime::zero;
+			ts.end.hour -= 24;
+		}
+
+		spans[_i].push_back(ts);
+	}
+
+	scheduleZone = NULL;
+	if (getline(in, line) && !line.empty())
+	{
+		try
+		{
+			scheduleZone = chrono::locate_zone(line);
+		}
+		catch (const std::exception&)
+		{
+			throw exception(format("Unknown time zone (Line 10) ({}).", line).c_str());
+		}
+	}
+}
+
+void MergeSchedule()
+{
+	for (int i = 0; i < 7; i++)
+	{
+		sort(spans[i].begin(), spans[i].end());
+
+		for (size_t j = 0; j + 1 < spans[i].size();)
+		{
+			TimeSpan& a = spans[i][j];
+			const TimeSpan& b = spans[i][j + 1];
+			if (a.overlapping(b, secondResolution ? DoubleTime::one_second : DoubleTime::one_minute))
+			{
+				a.start = min(a.start, b.start);
+				a.end = max(a.end, b.end);
+				spans[i].erase(spans[i].begin() + j + 1);
+			}
+			else j++;
+		}
+	}
+
+	CheckSleepTime();
+
+	weekIndex.Build(spans);
+	if (secondResolution) secondIndex.Build(spans);
+}
+
+
+bool VerifySpans(string& error)
+{
+	for (int d = 0; d < 7; d++)
+	{
+		for (const TimeSpan& ts : spans[d])
+		{
+			int32_t start = ts.start.to_seconds(), end = ts.end.to_seconds();
+			if (start < 0 || end >= SecondIndex::secondsPerDay || end < start)
+			{
+				error = format("Day {} has the span {}, which does not fit in the day.", d, ts.to_string());
+				return false;
+			}
+			if (!secondResolution && (ts.start.second != 0 || ts.end.second != 0))
+			{
+				error = format("Day {} has the span {} with seconds, but the schedule is in minutes.", d, ts.to_string());
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Differential check of the compiled index against a brute-force scan of the
+// merged spans: every minute of the week (every second, at second resolution)
+// must agree on being asleep, on the bounds of the window it is in and on
+// where the next window starts.
+bool VerifyIndex(string& error)
+{
+	const int32_t step = secondResolution ? 1 : 60;
+	const int32_t n = secondResolution ? SecondIndex::secondsPerWeek : WeekIndex::minutesPerWeek;
+
+	vector<bool> expected(n);
+	for (int d = 0; d < 7; d++)
+	{
+		for (const TimeSpan& ts : spans[d])
+		{
+			for (int32_t t = ts.start.to_seconds(); t <= ts.end.to_seconds(); t += step)
+			{
+				expected[(d * SecondIndex::secondsPerDay + t) / step] = true;
+			}
+		}
+	}
+
+	// Walk two weeks backwards so starts in the following week are found too
+	vector<int32_t> nextStart(n);
+	int32_t upcoming = -1;
+	for (int32_t i = 2 * n - 1; i >= 0; i--)
+	{
+		if (expected[i % n] && !expected[(i + n - 1) % n]) upcoming = i;
+		if (i < n) nextStart[i] = upcoming;
+	}
+
+	// Bounds of the run each asleep unit is in. A run across the end of the
+	// week starts below zero seen from its first day and ends past n seen
+	// from its last, the same frame Containing answers in.
+	int32_t lastRun = n, firstRun = 0;
+	while (lastRun > 0 && expected[lastRun - 1]) lastRun--;
+	while (firstRun < n && expected[firstRun]) firstRun++;
+
+	vector<int32_t> runStart(n), runEnd(n);
+	for (int32_t i = 0; i < n; i++)
+	{
+		if (!expected[i]) continue;
+		if (i > 0 && expected[i - 1]) runStart[i] = runStart[i - 1];
+		else runStart[i] = i == 0 && lastRun < n ? lastRun - n : i;
+	}
+	for (int32_t i = n; i-- > 0;)
+	{
+		if (!expected[i]) continue;
+		if (i + 1 < n && expected[i + 1]) runEnd[i] = runEnd[i + 1];
+		else runEnd[i] = i + 1 == n && firstRun > 0 ? n + firstRun : i + 1;
+	}
+
+	auto describe = [](bool any, int32_t start, int32_t end) { return any ? format("{}-{}", start, end) : string("none"); };
+
+	const char* unit = secondResolution ? "second" : "minute";
+	for (int32_t i = 0; i < n; i++)
+	{
+		bool asleep, contained;
+		int32_t start = -1;
+		MinuteWindow around;
+		if (secondResolution)
+		{
+			SecondWindow w;
+			asleep = secondIndex.Contains(i);
+			contained = secondIndex.Containing(i, around) != nullptr;
+			if (secondIndex.Next(i, w) != nullptr) start = w.start;
+		}
+		else
+		{
+			MinuteWindow w;
+			asleep = weekIndex.Test(i);
+			contained = weekIndex.Containing(i, around) != nullptr;
+			if (weekIndex.Next(i, w) != nullptr) start = w.start;
+		}
+
+		if (asleep != expected[i])
+		{
+			error = format("Index says {} at {} {} of the week, the spans say {}.", asleep ? "asleep" : "awake", unit, i, expected[i] ? "asleep" : "awake");
+			return false;
+		}
+		if (contained != expected[i] || contained && (around.start != runStart[i] || around.end != runEnd[i]))
+		{
+			error = format("Index says the window around {} {} of the week is {}, the spans say {}.", unit, i, describe(contained, around.start, around.end), describe(expected[i], runStart[i], runEnd[i]));
+			return false;
+		}
+		if (start != nextStart[i])
+		{
+			error = format("Index says the next window after {} {} of the week starts at {}, the spans say {}.", unit, i, start, nextStart[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool VerifyProjection(const WeekIndex& source, const chrono::time_zone* from, const chrono::time_zone* to, chrono::local_days weekStart, string& error)
+{
+	using namespace std::chrono;
+
+	ProjectionCache cache(to, 1);
+	const WeekIndex& projected = cache.Get(source, from, weekStart);
+
+	for (int32_t m = 0; m < WeekIndex::minutesPerWeek; m++)
+	{
+		// Minutes skipped or repeated by a change of the local clock have no single answer
+		local_minutes local = local_minutes{ weekStart } + minutes{ m };
+		local_info info = to->get_info(local);
+		if (info.result != local_info::unique) continue;
+
+		local_minutes s = floor<minutes>(from->to_local(sys_seconds{ (local - info.first.offset).time_since_epoch() }));
+		local_days d = floor<days>(s);
+		bool expected = source.Test(weekday{ d }.c_encoding() * WeekIndex::minutesPerDay + (int32_t)(s - d).count());
+
+		if (projected.Test(m) != expected)
+		{
+			error = format("Projection from {} to {} says {} at minute {} of the week of {:%F}, converting the minute says {}.",
+				from->name(), to->name(), projected.Test(m) ? "asleep" : "awake", m, weekStart, expected ? "asleep" : "awake");
+			return false;
+		}
+	}
+
+	// The window list must describe the same bits
+	WeekIndex compiled = projected;
+	compiled.Compile();
+	if (!equal(compiled.windows.begin(), compiled.windows.end(), projected.windows.begin(), projected.windows.end(),
+		[](const MinuteWindow& a, const MinuteWindow& b) { return a.start == b.start && a.end == b.end; }))
+	{
+		error = format("Projection from {} to {} for the week of {:%F} has windows that do not match its bits.", from->name(), to->name(), weekStart);
+		return false;
+	}
+
+	return true;
+}
+
+// Feeds random schedules, well formed and not, through the parser, the merge
+// and the checks above. Parse errors are expected; a crash or a failed check
+// is a bug, and the input is printed so it can be replayed. The Fuzz\
+// harnesses run the same checks under a coverage-guided fuzzer.
+int FuzzSchedules(int iterations, unsigned seed)
+{
+	using namespace std::chrono;
+
+	// A release build checks a minute schedule in well under a millisecond;
+	// seconds and projections take tens of milliseconds, so they are kept
+	// rare enough not to set the rate
+#ifdef _DEBUG
+	const double minExecsPerSecond = 100;
+#else
+	const double minExecsPerSecond = 1000;
+#endif
+
+	mt19937 rng(seed);
+	auto chance = [&](int oneIn) { return rng() % oneIn == 0; };
+	// Separators and digits, plus letters from zone names and \r from Windows line ends
+	const char alphabet[] = "0123456789:-,[] x\rabeinorstuzAEGMSTUZ/_+";
+	// Either side of every range check, and past what an int holds
+	const char* edges[] = { "167", "168", "24", "59", "60", "-1", "-0", "007", "2147483647", "2147483648", "99999999999999999999" };
+
+	auto number = [&](unsigned below) { return chance(16) ? string(edges[rng() % size(edges)]) : to_string(rng() % below); };
+	auto twoDigits = [&]() { return chance(16) ? string(edges[rng() % size(edges)]) : format("{:02}", rng() % 60); };
+
+	size_t accepted = 0, rejected = 0, projections = 0;
+	cout << format("Seed {}.", seed) << endl;
+	auto begin = steady_clock::now();
+
+	for (int it = 0; it < iterations; it++)
+	{
+		// Mostly valid times, with hours running past midnight
+		bool exact = chance(64);
+		const char* eol = chance(8) ? "\r\n" : "\n";
+		string input = number(100000) + eol + (chance(2) ? "true" : "false") + eol;
+		for (int d = 0; d < 7; d++)
+		{
+			input += '[';
+			for (int k = rng() % 4; k > 0; k--)
+			{
+				// Minute-form ends mixed in, which then run through :59
+				input += exact ? format("{}:{}:{}-{}:{}{}", number(40), twoDigits(), twoDigits(), number(40), twoDigits(), chance(2) ? ':' + twoDigits() : "")
+					: format("{}:{}-{}:{}", number(40), twoDigits(), number(40), twoDigits());
+				if (k > 1) input += ',';
+			}
+			input += ']';
+			input += eol;
+		}
+
+		// The optional tenth line names the zone the schedule is declared in
+		if (chance(4))
+		{
+			input += chance(8) ? "Not/AZone" : fuzzZones[rng() % size(fuzzZones)];
+			input += eol;
+		}
+
+		for (int m = chance(2) ? rng() % 4 : 0; m > 0; m--)
+		{
+			size_t at = rng() % (input.size() + 1);
+			switch (rng() % 3)
+			{
+			case 0: input.insert(input.begin() + at, alphabet[rng() % (sizeof(alphabet) - 1)]); break;
+			case 1: if (at < input.size()) input.erase(at, 1); break;
+			case 2: if (at < input.size()) input[at] = alphabet[rng() % (sizeof(alphabet) - 1)]; break;
+			}
+		}
+
+		try
+		{
+			istringstream in(input);
+			ParseSchedule(in);
+			MergeSchedule();
+		}
+		catch (const std::exception&)
+		{
+			rejected++;
+			continue;
+		}
+
+		accepted++;
+		string error;
+		bool ok = VerifySpans(error) && VerifyIndex(error);
+
+		// Around a DST change of some year, onto another of the zones
+		if (ok && scheduleZone != NULL && chance(64))
+		{
+			local_days week{ year(1990 + (int)(rng() % 60)) / (chance(2) ? March : October) / Sunday[1 + rng() % 4] };
+			ok = VerifyProjection(weekIndex, scheduleZone, locate_zone(fuzzZones[rng() % size(fuzzZones)]), week, error);
+			projections++;
+		}
+
+		if (!ok)
+		{
+			cout << error << endl << "Input:" << endl << input << endl;
+			return 1;
+		}
+	}
+
+	double elapsed = duration<double>(steady_clock::now() - begin).count();
+	double rate = iterations / max(elapsed, 1e-9);
+	cout << format("{} schedule(s) checked ({} projected), {} rejected by the parser, {:.0f} exec(s)/s.", accepted, projections, rejected, rate) << endl;
+	if (rate < minExecsPerSecond)
+	{
+		cout << format("Below the {:.0f} exec(s)/s target.", minExecsPerSecond) << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "Schedule.h"
+
+// The schedule being parsed. Each thread has its own, so the bundle compiler
+// can parse many schedules at once; the scheduler itself only ever hands
+// finished schedules between threads as snapshots.
+extern thread_local std::vector<TimeSpan> spans[7];
+extern thread_local WeekIndex weekIndex;
+// Set when any time in the schedule has seconds. Every time is then exact to
+// the second, ends written without seconds run through :59, and the loop
+// checks secondIndex instead.
+extern thread_local bool secondResolution;
+extern thread_local SecondIndex secondIndex;
+extern thread_local int sleepInterval;
+extern thread_local DoubleTime totalSleepTime;
+extern thread_local bool onLogon;
+// Zone the schedule is declared in, or NULL for the local wall clock
+extern thread_local const std::chrono::time_zone* scheduleZone;
+
+// Throws if the merged spans sleep for too long.
+void CheckSleepTime();
+
+// Reads a schedule in the Schedule.txt format into the globals, with spans
+// split at midnight but not yet merged. Throws on any malformed input.
+void ParseSchedule(std::istream& in);
+
+// Merges overlapping and adjacent spans within each day, then compiles the
+// indexes from the result.
+void MergeSchedule();
+
+// Oracles for the parser and the indexes, shared by the debug checks, the
+// --fuzz run and the fuzzing harnesses in Fuzz\. Each returns false and
+// describes the first disagreement in error.
+
+// Every span lies within its day and starts no later than it ends.
+bool VerifySpans(std::string& error);
+
+// The compiled indexes agree with a brute-force scan of the merged spans.
+bool VerifyIndex(std::string& error);
+
+// The source week projected from one zone onto another for the week that
+// starts on weekStart agrees with converting every local minute on its own.
+bool VerifyProjection(const WeekIndex& source, const std::chrono::time_zone* from, const std::chrono::time_zone* to, std::chrono::local_days weekStart, std::string& error);
+
+// Zones the fuzzers declare schedules in and project them onto: no DST, the
+// usual DST, a 30 minute DST shift and offsets off the hour
+constexpr const char* fuzzZones[] = { "UTC", "Europe/Berlin", "America/New_York", "Australia/Lord_Howe", "Asia/Kathmandu", "America/St_Johns", "Pacific/Chatham" };
+
+// Feeds random schedules through the parser, the merge and the oracles.
+// Returns 1 on the first failed check, or if the run falls below its
+// execs/s target.
+int FuzzSchedules(int iterations, unsigned seed);
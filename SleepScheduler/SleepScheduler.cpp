@@ -2,6 +2,7 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <algorithm>
+#include <atomic>
 #include <windows.h>
 #include <pathcch.h>
 #include <powrprof.h>
@@ -14,8 +15,26 @@
 #include <chrono>
 #include <vector>
 #include <fstream>
+#include <sstream>
+#include <map>
+#include <new>
+#include <memory>
+#include <thread>
+#include <random>
+#include <filesystem>
 #include <taskschd.h>
 
+#include "Schedule.h"
+#include "ScheduleFile.h"
+#include "QueryService.h"
+#include "ICalendar.h"
+#include "Analysis.h"
+#include "Projection.h"
+#include "SpscQueue.h"
+#include "Journal.h"
+#include "Bundle.h"
+#include "PowerBackend.h"
+
 #pragma comment(lib, "taskschd.lib")
 #pragma comment(lib, "comsupp.lib")
 #pragma comment(lib, "credui.lib")
@@ -32,6 +51,25 @@ using namespace std;
 
 #define LAZY_STR(wstr) ((const char*)(wstr.c_str()))
 
+#ifdef COUNT_ALLOCATIONS
+// Every global allocation bumps the count of the thread making it, so the
+// suspend loop can check that it never touches the heap once it is running
+// while the reload and backend threads allocate as they need to
+thread_local size_t allocationCount = 0;
+
+void* operator new(size_t size)
+{
+	allocationCount++;
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
 struct Task
 {
 	ITaskDefinition* pTask = NULL;
@@ -167,7 +205,7 @@ struct Task
 		return pTrigger;
 	}
 
-	ITimeTrigger* AddTimeTrigger(const wstring& start)
+	ITimeTrigger* AddTimeTrigger(const wchar_t* start)
 	{
 		ITrigger* pTrigger = AddTrigger(TASK_TRIGGER_TIME, L"Trigger{}");
 
@@ -176,11 +214,11 @@ struct Task
 		pTrigger->Release();
 		IF_ERROR_THROW("QueryInterface call failed for ITimeTrigger");
 
-		hr = pTimeTrigger->put_StartBoundary(_bstr_t(start.c_str()));
+		hr = pTimeTrigger->put_StartBoundary(_bstr_t(start));
 		if (FAILED(hr))
 		{
 			pTimeTrigger->Release();
-			ERROR_THROWF("Cannot add start boundary to trigger ({})", LAZY_STR(start));
+			ERROR_THROWF("Cannot add start boundary to trigger ({})", LAZY_STR(wstring(start)));
 		}
 		
 		return pTimeTrigger;
@@ -188,7 +226,7 @@ struct Task
 
 	ITimeTrigger* AddTimeTrigger(const wstring& start, const wstring& end)
 	{
-		ITimeTrigger* pTimeTrigger = AddTimeTrigger(start);
+		ITimeTrigger* pTimeTrigger = AddTimeTrigger(start.c_str());
 
 		hr = pTimeTrigger->put_EndBoundary(_bstr_t(end.c_str()));
 		if (FAILED(hr))
@@ -413,7 +451,7 @@ public:
 	}
 
 	// Time format: YYYY-MM-DDTHH:MM:SS
-	bool ScheduleEvent(const wstring& path, const wstring& folder, const wstring& time, bool startOnLogon)
+	bool ScheduleEvent(const wstring& path, const wstring& folder, const wchar_t* time, bool startOnLogon)
 	{
 		try
 		{
@@ -464,312 +502,983 @@ void AddDays(chrono::time_point<T,D>& time, unsigned nDays)
 	time = time_point<T, D>{ local_days(ymd) + hms.to_duration() };
 }
 
+// Time format: YYYY-MM-DDTHH:MM:SS, written into the caller's buffer
 template <class T, class D>
-wstring FormatTime(const chrono::time_point<T,D>& time)
+const wchar_t* FormatTime(const chrono::time_point<T,D>& time, wchar_t (&buffer)[20])
 {
-	using std::chrono::year_month_day, std::chrono::days, std::chrono::minutes, std::chrono::hh_mm_ss;
+	using std::chrono::year_month_day, std::chrono::days, std::chrono::seconds, std::chrono::hh_mm_ss;
 	year_month_day ymd{ floor<days>(time) };
-	hh_mm_ss hms{ floor<minutes>(time) - floor<days>(time) };
-	return format(L"{0:%Y}-{0:%m}-{0:%d}T{1:%H}:{1:%M}:{1:%S}", ymd, hms);
+	hh_mm_ss hms{ floor<seconds>(time) - floor<days>(time) };
+	*format_to_n(buffer, size(buffer) - 1, L"{0:%Y}-{0:%m}-{0:%d}T{1:%H}:{1:%M}:{1:%S}", ymd, hms).out = L'\0';
+	return buffer;
+}
+
+template<class T>
+string FormatSpan(const TimeSpan& time, const chrono::hh_mm_ss<T>& now)
+{
+	return format("{}-{}{:} ", time.start.to_string(), time.end.to_string(), time.contains(now) ? " (!!!)" : "");
 }
 
-struct DoubleTime
+string FormatSpan(const TimeSpan& time)
 {
-	int hour = 0;
-	int minute = 0;
+	return format("{}-{} ", time.start.to_string(), time.end.to_string());
+}
 
-	constexpr DoubleTime() : hour(0), minute(0) {}
-	constexpr DoubleTime(int _hour, int _minute) : hour(_hour), minute(_minute) {}
+const char fileName[] = "schedule.txt";
 
-	constexpr DoubleTime operator+ (const DoubleTime& t) const
+void ParseFile(const char* path = fileName)
+{
+	ifstream myfile(path);
+	if (!myfile.is_open()) throw exception("Cannot open schedule file.");
+
+	ParseSchedule(myfile);
+
+#ifdef _DEBUG
+	cout << "Schedule before merge: " << endl;
+	for (int i = 0; i < 7; i++)
 	{
-		return DoubleTime(hour + t.hour + (minute + t.minute) / 60, (minute + t.minute) % 60);
+		for (int j = 0; j < spans[i].size(); j++)
+		{
+			auto k = spans[i][j];
+			cout << FormatSpan(k);
+		}
+		cout << endl;
 	}
-	DoubleTime& operator+= (const DoubleTime& t) 
+	cout << endl;
+#endif
+
+	MergeSchedule();
+
+#ifdef _DEBUG
+	string error;
+	if (!VerifyIndex(error)) throw exception(error.c_str());
+#endif
+}
+
+// Writes weekIndex back out in the schedule file format. Windows crossing
+// midnight are written on the day they start, the same way a user would.
+void WriteFile()
+{
+	ofstream myfile(fileName);
+	if (!myfile.is_open()) throw exception("Cannot write schedule file.");
+
+	myfile << sleepInterval << endl;
+	myfile << (onLogon ? "true" : "false") << endl;
+
+	for (int i = 0; i < 7; i++)
 	{
-		hour += t.hour;
-		minute += t.minute;
-		hour += minute / 60;
-		minute %= 60;
-		return *this;
+		const int32_t dayStart = i * WeekIndex::minutesPerDay;
+		bool first = true;
+
+		myfile << '[';
+		for (const MinuteWindow& w : weekIndex.windows)
+		{
+			if (w.start < dayStart || w.start >= dayStart + WeekIndex::minutesPerDay) continue;
+
+			int32_t start = w.start - dayStart;
+			int32_t end = w.end - 1 - dayStart;
+			if (w.end - w.start <= WeekIndex::minutesPerDay) end %= WeekIndex::minutesPerDay;
+			myfile << (first ? "" : ",") << format("{}:{:02}-{}:{:02}", start / 60, start % 60, end / 60, end % 60);
+			first = false;
+		}
+		myfile << ']' << endl;
 	}
-	constexpr DoubleTime operator- (const DoubleTime& t) const
+
+	if (scheduleZone != NULL) myfile << scheduleZone->name() << endl;
+}
+
+// Replaces the windows in the schedule file with the events in an iCalendar
+// file, keeping the interval and logon settings if the old file parses.
+void ImportFile(const char* path)
+{
+	try
 	{
-		return DoubleTime(hour - t.hour - (59 - (minute - t.minute)) / 60, (60 + (minute - t.minute)) % 60);
+		ParseFile();
 	}
-	DoubleTime& operator-= (const DoubleTime& t)
+	catch (const std::exception&)
 	{
-		hour -= t.hour;
-		minute -= t.minute;
-		hour -= (59 - minute) / 60;
-		minute = (60 + minute) % 60;
-		return *this;
+		sleepInterval = 60000;
+		onLogon = false;
 	}
 
-	constexpr bool operator== (const DoubleTime& t) const
+	ifstream calendar(path, ios::binary);
+	if (!calendar.is_open()) throw exception(format("Cannot open calendar file ({}).", path).c_str());
+
+	weekIndex = WeekIndex();
+	secondResolution = false;
+	ICalendarStats stats = ImportICalendar(calendar, weekIndex, scheduleZone != NULL ? scheduleZone : chrono::current_zone());
+	weekIndex.ToSpans(spans);
+	CheckSleepTime();
+	WriteFile();
+
+	double seconds = chrono::duration<double>(stats.elapsed).count();
+	cout << format("Imported {} event(s) ({} skipped) from {} byte(s) in {:.3f}s ({:.1f} MB/s, {:.0f} events/s).",
+		stats.events, stats.skipped, stats.bytes, seconds, stats.bytes / seconds / 1e6, stats.events / seconds) << endl;
+	if (stats.unknownZones > 0) cout << format("{} event(s) were in a time zone the calendar does not define.", stats.unknownZones) << endl;
+}
+
+// Imports a generated calendar of events from memory, so only the parser is
+// timed. Returns 1 if any event went missing or its zone was not found.
+int BenchmarkICalendar(size_t events, unsigned seed)
+{
+	ostringstream generated;
+	GenerateICalendar(generated, events, seed);
+	istringstream calendar(generated.str());
+
+	WeekIndex week;
+	ICalendarStats stats = ImportICalendar(calendar, week, chrono::current_zone());
+
+	double seconds = chrono::duration<double>(stats.elapsed).count();
+	cout << format("{} event(s) ({} skipped) from {} byte(s) in {:.3f}s ({:.1f} MB/s, {:.0f} events/s).",
+		stats.events, stats.skipped, stats.bytes, seconds, stats.bytes / seconds / 1e6, (stats.events + stats.skipped) / seconds) << endl;
+
+	if (stats.events + stats.skipped != events || stats.unknownZones != 0)
 	{
-		return hour == t.hour && minute == t.minute;
+		cout << format("Expected {} event(s), {} of them in an unknown zone.", events, stats.unknownZones) << endl;
+		return 1;
 	}
-	constexpr bool operator> (const DoubleTime& t) const
+	return 0;
+}
+
+void ExportFile(const char* path, int weekCount)
+{
+	using namespace std::chrono;
+
+	ofstream calendar(path, ios::binary);
+	if (!calendar.is_open()) throw exception(format("Cannot open calendar file ({}).", path).c_str());
+
+	local_days today = floor<days>(zoned_time{ scheduleZone != NULL ? scheduleZone : current_zone(), system_clock::now() }.get_local_time());
+	ExportICalendar(calendar, weekIndex, today - days{ weekday{ today }.c_encoding() }, weekCount, scheduleZone);
+}
+
+// Times the same pseudo-random probes against both forms of the loaded
+// schedule; the second runs only exist at second resolution
+void BenchmarkIndex(int lookups)
+{
+	using namespace std::chrono;
+
+	lookups = max(lookups, 1);
+	size_t minuteHits = 0, secondHits = 0;
+	auto t0 = steady_clock::now();
+	for (int i = 0; i < lookups; i++) minuteHits += weekIndex.Test((int32_t)(i * 7919ll % WeekIndex::minutesPerWeek));
+	auto t1 = steady_clock::now();
+	cout << format("Minute bitmap: {} byte(s), {:.1f} ns/lookup ({} hit(s)).", sizeof(WeekIndex) + weekIndex.windows.capacity() * sizeof(MinuteWindow), duration<double, nano>(t1 - t0).count() / lookups, minuteHits) << endl;
+
+	if (!secondResolution) return;
+
+	for (int i = 0; i < lookups; i++) secondHits += secondIndex.Contains((int32_t)(i * 7919ll % SecondIndex::secondsPerWeek));
+	auto t2 = steady_clock::now();
+	cout << format("Second runs: {} byte(s), {:.1f} ns/lookup ({} hit(s), {} window(s)).", secondIndex.MemoryBytes(), duration<double, nano>(t2 - t1).count() / lookups, secondHits, secondIndex.windows.size()) << endl;
+}
+
+// Writes coverage statistics for each schedule to a CSV or JSON report,
+// depending on the extension of outPath
+void ReportFiles(const char* outPath, int argc, char** argv)
+{
+	using namespace std::chrono;
+
+	const time_zone* zone = current_zone();
+	int reportYear = (int)year_month_day{ floor<days>(zone->to_local(system_clock::now())) }.year();
+	int peakStart = 9 * 60;
+	int peakEnd = 17 * 60;
+	vector<const char*> paths;
+
+	for (int i = 0; i < argc; i++)
 	{
-		return hour > t.hour || hour == t.hour && minute > t.minute;
+		if (strcmp(argv[i], "--year") == 0 && i + 1 < argc)
+		{
+			reportYear = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--peak") == 0 && i + 1 < argc)
+		{
+			int h1, m1, h2, m2;
+			if (sscanf(argv[++i], "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4) throw exception(format("Invalid peak hours ({}).", argv[i]).c_str());
+			peakStart = h1 * 60 + m1;
+			peakEnd = h2 * 60 + m2;
+		}
+		else paths.push_back(argv[i]);
 	}
-	constexpr bool operator>= (const DoubleTime& t) const
+
+	if (paths.empty()) paths.push_back(fileName);
+	if (peakEnd <= peakStart) peakEnd += WeekIndex::minutesPerDay;
+
+	// Peak hours are Monday to Friday
+	WeekIndex peak;
+	for (int d = 1; d <= 5; d++)
 	{
-		return hour > t.hour || hour == t.hour && minute >= t.minute;
+		peak.SetRange(d * WeekIndex::minutesPerDay + peakStart, d * WeekIndex::minutesPerDay + peakEnd - 1);
 	}
-	constexpr bool operator< (const DoubleTime& t) const
+
+	string outName(outPath);
+	bool json = outName.size() >= 5 && outName.compare(outName.size() - 5, 5, ".json") == 0;
+
+	ofstream report(outPath);
+	if (!report.is_open()) throw exception(format("Cannot open report file ({}).", outPath).c_str());
+
+	// Schedules declared in another zone change clocks on that zone's dates
+	map<const time_zone*, YearInfo> years;
+	auto begin = steady_clock::now();
+
+	WriteReportHeader(report, json);
+	for (size_t i = 0; i < paths.size(); i++)
 	{
-		return hour < t.hour || hour == t.hour && minute < t.minute;
+		try
+		{
+			ParseFile(paths[i]);
+		}
+		catch (const std::exception& e)
+		{
+			throw exception(format("{}: {}", paths[i], e.what()).c_str());
+		}
+
+		const time_zone* z = scheduleZone != NULL ? scheduleZone : zone;
+		auto year = years.find(z);
+		if (year == years.end()) year = years.emplace(z, LoadYear(reportYear, z)).first;
+
+		ScheduleReport r = Analyse(weekIndex, peak, year->second);
+		r.name = paths[i];
+		WriteReport(report, r, json, i == 0);
 	}
-	constexpr bool operator<= (const DoubleTime& t) const
+	WriteReportFooter(report, json);
+
+	double seconds = duration<double>(steady_clock::now() - begin).count();
+	cout << format("Analysed {} schedule(s) in {:.3f}s ({:.0f} schedules/s).", paths.size(), seconds, paths.size() / seconds) << endl;
+}
+
+// Parses every schedule in parallel and writes them out as one bundle. A
+// directory contributes its *.txt files; each host is named after its file.
+void CompileBundle(const char* outPath, int argc, char** argv)
+{
+	using namespace std::chrono;
+
+	vector<filesystem::path> paths;
+	for (int i = 0; i < argc; i++)
 	{
-		return hour < t.hour || hour == t.hour && minute <= t.minute;
+		if (filesystem::is_directory(argv[i]))
+		{
+			for (const auto& entry : filesystem::directory_iterator(argv[i]))
+			{
+				if (entry.path().extension() == ".txt") paths.push_back(entry.path());
+			}
+		}
+		else paths.push_back(argv[i]);
 	}
+	if (paths.empty()) throw exception("No schedule files to compile.");
+
+	vector<BundleInput> inputs(paths.size());
+	vector<string> errors(paths.size());
+	atomic<size_t> nextPath = 0;
+	auto begin = steady_clock::now();
 
-	string to_string() const
+	// The schedule globals are per thread, so every worker parses on its own
+	auto work = [&]()
 	{
-		return format("{:02}:{:02}", hour, minute);
-	}
+		for (size_t i; (i = nextPath++) < paths.size();)
+		{
+			try
+			{
+				ifstream in(paths[i]);
+				if (!in.is_open()) throw exception("Cannot open schedule file.");
+
+				ParseSchedule(in);
+				MergeSchedule();
+
+				BundleInput& input = inputs[i];
+				input.host = paths[i].stem().string();
+				input.sleepInterval = sleepInterval;
+				input.onLogon = onLogon;
+				if (scheduleZone != NULL) input.zone = scheduleZone->name();
+				SerializeEntry(weekIndex, secondResolution ? &secondIndex : nullptr, input);
+			}
+			catch (const std::exception& e)
+			{
+				errors[i] = e.what();
+			}
+		}
+	};
 
-	constexpr unsigned int to_minutes() const
+	unsigned threadCount = (unsigned)min<size_t>(max(thread::hardware_concurrency(), 1u), paths.size());
+	vector<thread> workers;
+	for (unsigned i = 1; i < threadCount; i++) workers.emplace_back(work);
+	work();
+	for (thread& t : workers) t.join();
+
+	for (size_t i = 0; i < paths.size(); i++)
 	{
-		return hour * 60 + minute;
+		if (!errors[i].empty()) throw exception(format("{}: {}", paths[i].string(), errors[i]).c_str());
 	}
 
-	static const DoubleTime one_day;
-	static const DoubleTime one_hour;
-	static const DoubleTime one_minute;
-	static const DoubleTime zero;
-};
-const DoubleTime DoubleTime::one_day = DoubleTime(24, 0);
-const DoubleTime DoubleTime::one_hour = DoubleTime(1, 0);
-const DoubleTime DoubleTime::one_minute = DoubleTime(0, 1);
-const DoubleTime DoubleTime::zero = DoubleTime(0, 0);
+	BundleStats stats = WriteBundle(outPath, inputs);
+
+	double seconds = duration<double>(steady_clock::now() - begin).count();
+	cout << format("Compiled {} host(s) into {} distinct schedule(s), {} byte(s), in {:.3f}s on {} thread(s).", stats.hosts, stats.entries, stats.bytes, seconds, threadCount) << endl;
+}
 
-struct TimeSpan
+// Takes this computer's schedule out of a compiled bundle. Only the host
+// table and this host's entry are mapped.
+void LoadBundle(const char* path)
 {
-	DoubleTime start;
-	DoubleTime end;
+	// The DNS host name, not the NetBIOS one, which is cut to 15 characters
+	char host[sizeof(BundleHost::name)];
+	DWORD size = sizeof(host);
+	if (!GetComputerNameExA(ComputerNameDnsHostname, host, &size)) throw exception("Cannot get the computer name.");
+
+	BundleSchedule schedule;
+	if (!ReadBundle(path, host, schedule)) throw exception(format("This computer is not in the bundle ({}).", host).c_str());
+
+	weekIndex = move(schedule.weekIndex);
+	secondResolution = schedule.secondResolution;
+	secondIndex = move(schedule.secondIndex);
+	sleepInterval = schedule.sleepInterval;
+	onLogon = schedule.onLogon;
+	scheduleZone = schedule.zone.empty() ? NULL : chrono::locate_zone(schedule.zone);
+
+	weekIndex.ToSpans(spans);
+}
 
-	bool overlapping(const TimeSpan& t) const
+// A bundle next to the executable wins over Schedule.txt
+void LoadSchedule()
+{
+	if (GetFileAttributesA(bundleName) != INVALID_FILE_ATTRIBUTES) LoadBundle(bundleName);
+	else ParseFile();
+}
+
+void SetPrivilege(const wstring& privilege, bool enable)
+{
+	HANDLE hToken;
+	OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken);
+
+	TOKEN_PRIVILEGES tp;
+	if (!LookupPrivilegeValue(NULL, privilege.c_str(), &tp.Privileges[0].Luid))
 	{
-		if (t < *this) return t.overlapping(*this);
-		return end.hour > t.start.hour || end.hour == t.start.hour && end.minute + 1 >= t.start.minute;
+		throw exception(format("LookupPrivilegeValue error: {}", GetLastError()).c_str());
 	}
 
-	bool operator== (const TimeSpan& t) const
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = enable ? SE_PRIVILEGE_ENABLED : 0;
+
+	if (!AdjustTokenPrivileges(
+		hToken,
+		FALSE,
+		&tp,
+		sizeof(TOKEN_PRIVILEGES),
+		(PTOKEN_PRIVILEGES)NULL,
+		(PDWORD)NULL
+	))
 	{
-		return start == t.start;
+		throw exception(format("AdjustTokenPrivileges error: {}", GetLastError()).c_str());
 	}
-	bool operator> (const TimeSpan& t) const
+
+	if (GetLastError() == ERROR_NOT_ALL_ASSIGNED)
 	{
-		return start > t.start;
+		throw exception("The token does not have the specified privilege.");
 	}
-	bool operator< (const TimeSpan& t) const
+}
+
+// The Task Scheduler and SetSuspendState
+class WindowsBackend : public PowerBackend
+{
+private:
+	wstring path;
+	wstring folder;
+
+public:
+	WindowsBackend(const wstring& _path, const wstring& _folder) : path(_path), folder(_folder) {}
+
+	const char* Name() const override { return "windows"; }
+
+	void AcquirePrivilege() override
 	{
-		return start < t.start;
+		SetPrivilege(SE_SHUTDOWN_NAME, true);
 	}
 
-	bool contains(const DoubleTime& time) const
+	void Suspend(chrono::system_clock::time_point wakeAt) override
 	{
-		return time >= start && time <= end;
+#ifdef _DEBUG
+		// Never suspend a development machine, wait for a key instead
+		getchar();
+#else
+		HANDLE timer = NULL;
+		if (wakeAt != noWake)
+		{
+			// Waitable timers count 100ns steps from 1601, in UTC
+			LARGE_INTEGER due;
+			due.QuadPart = chrono::duration_cast<chrono::duration<int64_t, ratio<1, 10000000>>>(wakeAt.time_since_epoch()).count() + 116444736000000000ll;
+
+			timer = CreateWaitableTimer(NULL, TRUE, NULL);
+			if (timer != NULL) SetWaitableTimer(timer, &due, 0, NULL, NULL, TRUE);
+		}
+
+		SetSuspendState(false, false, false);
+		if (timer != NULL) CloseHandle(timer);
+#endif
 	}
-	
-	template<class T>
-	bool contains(const chrono::hh_mm_ss<T>& time) const
+
+	bool RelaunchAt(chrono::sys_seconds at, bool onLogon) override
 	{
-		DoubleTime t( time.hours().count(), time.minutes().count() );
-		return contains(t);
+		// COM is per thread, so each registering thread keeps its own service
+		thread_local TaskService tserv;
+
+		// Time triggers without a zone are on the local wall clock
+		wchar_t time[20];
+		return tserv.ScheduleEvent(path, folder, FormatTime(chrono::current_zone()->to_local(at), time), onLogon);
 	}
+};
 
-	string to_string() const
+// Everything the timing thread needs from one parse of the schedule file.
+// Never modified once published, so any thread may hold one.
+struct ScheduleSnapshot
+{
+	WeekIndex weekIndex;
+	SecondIndex secondIndex;
+	bool secondResolution = false;
+	const chrono::time_zone* scheduleZone = NULL;
+	int sleepInterval = 0;
+	bool onLogon = false;
+	uint64_t hash = 0;
+};
+
+// Identifies the schedule across runs, so the journal of an older schedule
+// is never trusted. Covers everything a registration depends on, so a
+// changed log-on flag or interval is registered again too.
+uint64_t ScheduleHash()
+{
+	uint64_t hash = Fnv1a(weekIndex.bits, sizeof(weekIndex.bits));
+	if (secondResolution) hash = Fnv1a(secondIndex.windows.data(), secondIndex.windows.size() * sizeof(SecondWindow), hash);
+	if (scheduleZone != NULL) hash = Fnv1a(scheduleZone->name().data(), scheduleZone->name().size(), hash);
+	hash = Fnv1a(&sleepInterval, sizeof(sleepInterval), hash);
+	return Fnv1a(&onLogon, sizeof(onLogon), hash);
+}
+
+shared_ptr<const ScheduleSnapshot> TakeSnapshot()
+{
+	return make_shared<const ScheduleSnapshot>(ScheduleSnapshot{ weekIndex, secondIndex, secondResolution, scheduleZone, sleepInterval, onLogon, ScheduleHash() });
+}
+
+// Counts the sleep windows that began at or after from and were over by to,
+// both on the schedule's clock, and returns the first of them
+int MissedWindows(const ScheduleSnapshot& snapshot, chrono::local_seconds from, chrono::local_seconds to, chrono::local_seconds& firstStart, chrono::local_seconds& firstEnd)
+{
+	using namespace std::chrono;
+
+	int count = 0;
+	// After a long outage the first window and a count are enough
+	for (local_seconds t = from; count < 1000;)
 	{
-		return format("{}-{}", start.to_string(), end.to_string());
+		local_days day = floor<days>(t);
+		local_days weekStart = day - days{ weekday{ day }.c_encoding() };
+		int32_t offset = (int32_t)(t - local_seconds{ weekStart }).count();
+
+		local_seconds start, end;
+		if (snapshot.secondResolution)
+		{
+			SecondWindow w;
+			if (snapshot.secondIndex.Next(offset, w) == nullptr) break;
+			start = weekStart + seconds(w.start);
+			end = weekStart + seconds(w.end);
+		}
+		else
+		{
+			// Round up, a window that started before from was not missed
+			MinuteWindow w;
+			if (snapshot.weekIndex.Next((offset + 59) / 60, w) == nullptr) break;
+			start = weekStart + minutes(w.start);
+			end = weekStart + minutes(w.end);
+		}
+
+		if (end > to) break;
+		if (count++ == 0)
+		{
+			firstStart = start;
+			firstEnd = end;
+		}
+		t = end;
 	}
 
-	DoubleTime length() const
+	return count;
+}
+
+// A trigger for the backend to register. Plain data, so handing it over
+// does not allocate
+struct Registration
+{
+	chrono::local_seconds next; // On the local wall clock
+	bool onLogon;
+};
+
+typedef SpscQueue<shared_ptr<const ScheduleSnapshot>, 4> SnapshotQueue;
+
+// Shared by the timing thread, which posts triggers, and the backend worker,
+// which registers them
+struct Backend
+{
+	PowerBackend& power;
+	SpscQueue<Registration, 16> queue;
+	atomic<uint32_t> wake = 0;
+	atomic<bool> stopping = false;
+	atomic<bool> failed = false;
+	// Last trigger the Task Scheduler accepted, in Unix seconds
+	atomic<int64_t> registered = 0;
+
+	Backend(PowerBackend& _power) : power(_power) {}
+
+	bool Post(const Registration& r)
 	{
-		return end - start;
+		if (!queue.Push(r)) return false;
+		wake++;
+		wake.notify_one();
+		return true;
+	}
+
+	void Stop()
+	{
+		stopping = true;
+		wake++;
+		wake.notify_one();
 	}
 };
 
-template<class T>
-string FormatSpan(const TimeSpan& time, const chrono::hh_mm_ss<T>& now)
+// Backend worker: makes the registration calls, the only slow ones left.
+void RunBackend(Backend& backend)
 {
-	return format("{:02}:{:02}-{:02}:{:02}{:} ", time.start.hour, time.start.minute, time.end.hour, time.end.minute, time.contains(now) ? " (!!!)" : "");
+	try
+	{
+		Registration r;
+
+		while (true)
+		{
+			uint32_t seen = backend.wake;
+			// Read before draining, so a trigger posted before Stop() is never missed
+			bool stopping = backend.stopping;
+
+			// Only the latest trigger matters
+			bool any = false;
+			while (backend.queue.Pop(r)) any = true;
+
+			if (any)
+			{
+#ifdef _DEBUG
+				auto begin = chrono::steady_clock::now();
+#endif
+				// Resolved here rather than on the timing thread, the zone lookup may allocate
+				chrono::sys_seconds at = chrono::current_zone()->to_sys(r.next, chrono::choose::earliest);
+				bool ok = backend.power.RelaunchAt(at, r.onLogon);
+				backend.failed = !ok;
+				if (ok) backend.registered = at.time_since_epoch().count();
+
+				wchar_t time[20];
+				if (ok) wcout << L"Scheduled next check: " << FormatTime(r.next, time) << endl;
+				else wcout << L"Failed to schedule task." << endl;
+#ifdef _DEBUG
+				cout << format("{} backend registered in {} us.", backend.power.Name(), chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count()) << endl;
+#endif
+				continue;
+			}
+
+			if (stopping) break;
+			backend.wake.wait(seen);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		cout << "Cannot register the next check:" << endl;
+		cout << e.what() << endl;
+		backend.failed = true;
+	}
 }
 
-string FormatSpan(const TimeSpan& time)
+// True if a change notification names the schedule file or the bundle. The
+// journal lives in the same directory and is written every pass, so any
+// other change must not cause a reload.
+bool IsScheduleChange(const BYTE* buffer, DWORD bytes)
 {
-	return format("{:02}:{:02}-{:02}:{:02} ", time.start.hour, time.start.minute, time.end.hour, time.end.minute);
-}
+	// The buffer overflowed and the names were lost, assume the worst
+	if (bytes == 0) return true;
 
-vector<TimeSpan> spans[7];
-int sleepInterval = 0;
-DoubleTime totalSleepTime;
-bool onLogon = false;
-const char fileName[] = "schedule.txt";
+	auto matches = [](const FILE_NOTIFY_INFORMATION* info, const char* name)
+	{
+		size_t length = info->FileNameLength / sizeof(WCHAR);
+		if (length != strlen(name)) return false;
+		for (size_t i = 0; i < length; i++)
+		{
+			if (towlower(info->FileName[i]) != (wint_t)tolower((unsigned char)name[i])) return false;
+		}
+		return true;
+	};
 
-void ParseFile()
+	for (const BYTE* p = buffer;;)
+	{
+		const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)p;
+		if (matches(info, fileName) || matches(info, bundleName)) return true;
+		if (info->NextEntryOffset == 0) return false;
+		p += info->NextEntryOffset;
+	}
+}
+
+// Reload thread: re-parses the schedule whenever the schedule file or the
+// bundle changes and hands the result to the timing thread. Editors often
+// save in several writes, so a reload that comes out the same as the last
+// snapshot pushed is dropped rather than resetting the timing thread.
+void RunReload(SnapshotQueue& snapshots, HANDLE stopEvent, uint64_t lastHash)
 {
-	ifstream myfile(fileName);
-	if (!myfile.is_open()) throw exception("Cannot open schedule file.");
+	HANDLE directory = CreateFile(L".", FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (directory == INVALID_HANDLE_VALUE) return;
 
-	for (int i = 0; i < 7; i++)
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	alignas(DWORD) BYTE buffer[4096];
+	DWORD bytes;
+
+	HANDLE handles[] = { stopEvent, overlapped.hEvent };
+	while (ReadDirectoryChangesW(directory, buffer, sizeof(buffer), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME, NULL, &overlapped, NULL) &&
+		WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
 	{
-		spans[i] = vector<TimeSpan>();
+		if (!GetOverlappedResult(directory, &overlapped, &bytes, FALSE)) break;
+		ResetEvent(overlapped.hEvent);
+		if (!IsScheduleChange(buffer, bytes)) continue;
+
+		try
+		{
+			LoadSchedule();
+			shared_ptr<const ScheduleSnapshot> snapshot = TakeSnapshot();
+			if (snapshot->hash == lastHash) continue;
+
+			// The timing thread drains the queue every pass, it can only be full while suspended
+			while (!snapshots.Push(snapshot) && WaitForSingleObject(stopEvent, 100) == WAIT_TIMEOUT);
+			lastHash = snapshot->hash;
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Error reloading schedule file:" << endl;
+			cout << e.what() << endl;
+		}
 	}
 
-	string line;
-	getline(myfile, line);
-	istringstream ss(line);
+	// The read may still be pending on the buffer, wait for it to be cancelled
+	if (CancelIoEx(directory, &overlapped)) GetOverlappedResult(directory, &overlapped, &bytes, TRUE);
+	CloseHandle(overlapped.hEvent);
+	CloseHandle(directory);
+}
 
-	ss >> sleepInterval;
+// What the timing thread reports about its suspend decisions
+struct TimerStats
+{
+	atomic<size_t> passes = 0;
+	chrono::steady_clock::duration worstDecision{};
+};
 
-	getline(myfile, line);
-	onLogon = line == "true" || line == "True" || line == "TRUE";
+// Timing thread: owns the suspend decision and keeps the backend told about
+// the next trigger. Only reads snapshots, so it never waits on the file
+// system or COM. Returns once the machine should stay awake.
+// posted is a trigger a previous run already registered, if any.
+void RunTimer(shared_ptr<const ScheduleSnapshot> snapshot, SnapshotQueue& snapshots, Backend& backend, Journal& journal, chrono::local_time<chrono::seconds> posted, TimerStats& stats)
+{
+	using namespace std::chrono;
 
-	for (int i = 0; i < 7; i++)
+	// current_zone() and get_info() allocate on some standard libraries, so
+	// look the zone up once and only refresh the offset at DST transitions
+	const time_zone* zone = current_zone();
+	sys_info zoneInfo = zone->get_info(system_clock::now());
+
+	// Schedules declared in another zone are checked against their projection
+	// onto the local week, which only changes when the week rolls over
+	ProjectionCache projections(zone);
+	const WeekIndex* active = NULL;
+	local_days activeWeek{};
+
+	// Second resolution schedules are checked on their own clock instead, a
+	// binary search over their runs is cheap enough to need no projection.
+	// The search is only repeated once the clock reaches the next boundary
+	// between asleep and awake, or goes back past where it last searched.
+	const time_zone* exactZone = NULL;
+	sys_info exactInfo;
+	const local_time<system_clock::duration> never = local_time<system_clock::duration>::max();
+	local_time<system_clock::duration> exactFrom = never, exactUntil = never;
+	local_days exactWeek{};
+	int32_t exactSecond = 0;
+	bool exactAsleep = false;
+	SecondWindow exactWindow{};
+
+	// The next trigger only changes with the schedule or the current window
+	const local_time<seconds> awake = local_time<seconds>::min();
+	local_time<seconds> triggerFor = awake;
+	bool fresh = true;
+	bool triggerDirty = true;
+
+#ifdef COUNT_ALLOCATIONS
+	size_t steadyAllocations = SIZE_MAX;
+#endif
+
+	while (true)
 	{
-		getline(myfile, line);
-		ss = istringstream(line);
+		shared_ptr<const ScheduleSnapshot> reloaded;
+		while (snapshots.Pop(reloaded))
+		{
+			snapshot = move(reloaded);
+			fresh = true;
+		}
 
-		if (ss.get() != '[')
+		sys_time<system_clock::duration> now = system_clock::now();
+		auto decideStart = steady_clock::now();
+
+		if (fresh)
 		{
-			throw exception(format("Schedule file improperly formatted (Line {}) (No opening bracket).", i + 1).c_str());
+			projections.Clear();
+			active = &snapshot->weekIndex;
+			activeWeek = local_days{};
+			exactZone = snapshot->scheduleZone != NULL ? snapshot->scheduleZone : zone;
+			exactInfo = exactZone->get_info(now);
+			exactFrom = never;
+			fresh = false;
+			triggerDirty = true;
+			if (journal.state.hash != snapshot->hash) journal.Append(JournalKind::Schedule, snapshot->hash);
+#ifdef COUNT_ALLOCATIONS
+			steadyAllocations = SIZE_MAX;
+#endif
 		}
-		if (ss.peek() == ']') continue;
 
-		do
+		if (now < zoneInfo.begin || now >= zoneInfo.end)
 		{
-			TimeSpan ts;
-			ss >> ts.start.hour;
-			if (ss.get() != ':') throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
-			ss >> ts.start.minute;
-			if (ss.get() != '-') throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
-			ss >> ts.end.hour;
-			if (ss.get() != ':') throw exception(format("Schedule file improperly formatted (Line {}) (Time formatted incorrectly).", i + 1).c_str());
-			ss >> ts.end.minute;
+			zoneInfo = zone->get_info(now);
+#ifdef COUNT_ALLOCATIONS
+			steadyAllocations = SIZE_MAX;
+#endif
+		}
 
-			if(ts.start.hour < 0 || ts.start.minute < 0 || ts.end.hour < 0 || ts.end.minute < 0)
-				throw exception(format("Cannot have negative time (Line {}) ({}).", i + 1, ts.to_string()).c_str());
+		local_time<system_clock::duration> tp{ (now + zoneInfo.offset).time_since_epoch() };
+		local_days day = floor<days>(tp);
+		// Sun - Sat, 0-6
+		local_days weekStart = day - days{ weekday{ day }.c_encoding() };
 
-			if (ts.start.minute >= 60 || ts.end.minute >= 60)
-				throw exception(format("Cannot have minutes over 60 (Line {}) ({}).", i + 1, ts.to_string()).c_str());
+		bool asleep;
+		local_time<seconds> window = awake;
+		int64_t windowStart = 0, windowEnd = 0; // Unix seconds
+		bool hasNext = false;
+		local_time<seconds> next;
 
-			int _i = i;
+		if (snapshot->secondResolution)
+		{
+			if (now < exactInfo.begin || now >= exactInfo.end)
+			{
+				exactInfo = exactZone->get_info(now);
+#ifdef COUNT_ALLOCATIONS
+				steadyAllocations = SIZE_MAX;
+#endif
+			}
 
-			while (ts.end < ts.start) ts.end.hour += 24;
+			local_time<system_clock::duration> exact{ (now + exactInfo.offset).time_since_epoch() };
+			if (exact < exactFrom || exact >= exactUntil)
+			{
+				local_days exactDay = floor<days>(exact);
+				exactWeek = exactDay - days{ weekday{ exactDay }.c_encoding() };
+				exactSecond = weekday{ exactDay }.c_encoding() * SecondIndex::secondsPerDay + (int32_t)floor<seconds>(exact - exactDay).count();
+
+				exactAsleep = snapshot->secondIndex.Containing(exactSecond, exactWindow) != NULL;
+				int32_t boundary = snapshot->secondIndex.NextBoundary(exactSecond);
+				// Boundaries may lie in the next week, or a window in the last one
+				exactFrom = exactWeek + seconds(exactSecond);
+				exactUntil = boundary < 0 ? never : exactWeek + seconds(boundary);
+			}
 
-			while (ts.start.hour >= 24)
+			SecondWindow w = exactWindow;
+			asleep = exactAsleep;
+			if (asleep)
 			{
-				_i = (_i + 1) % 7;
-				ts.start.hour -= 24;
-				ts.end.hour -= 24;
+				window = exactWeek + seconds(w.start);
+				windowStart = (window.time_since_epoch() - exactInfo.offset).count();
+				windowEnd = windowStart + w.end - w.start;
 			}
 
-			while (ts.end.hour >= 24)
+			if (triggerDirty || window != triggerFor)
 			{
-				spans[_i].push_back(TimeSpan(ts.start, DoubleTime(23, 59)));
-				_i = (_i + 1) % 7;
+				// While asleep the next trigger is the window after this one
+				int32_t from = asleep ? w.end : exactSecond;
+				local_days base = exactWeek;
+				if (from >= SecondIndex::secondsPerWeek)
+				{
+					from -= SecondIndex::secondsPerWeek;
+					base += weeks{ 1 };
+				}
 
-				ts.start = DoubleTime::zero;
-				ts.end.hour -= 24;
+				hasNext = snapshot->secondIndex.Next(from, w) != NULL;
+				next = base + seconds(w.start);
+				if (hasNext && snapshot->scheduleZone != NULL) next = zone->to_local(snapshot->scheduleZone->to_sys(next, choose::earliest));
 			}
-
-			spans[_i].push_back(ts);
 		}
-		while (ss.get() == ',');
+		else
+		{
+			int32_t minuteOfWeek = weekday{ day }.c_encoding() * WeekIndex::minutesPerDay + (int32_t)floor<minutes>(tp - day).count();
 
-		ss.unget();
+			if (snapshot->scheduleZone != NULL && weekStart != activeWeek)
+			{
+				active = &projections.Get(snapshot->weekIndex, snapshot->scheduleZone, weekStart);
+				activeWeek = weekStart;
+#ifdef COUNT_ALLOCATIONS
+				steadyAllocations = SIZE_MAX;
+#endif
+			}
 
-		if(ss.peek() != ']') throw exception(format("Invalid character (Line {}) ({}).", i + 1, (char)ss.get()).c_str());
-	}
+			MinuteWindow w;
+			asleep = active->Containing(minuteOfWeek, w) != NULL;
+			if (asleep)
+			{
+				window = weekStart + minutes(w.start);
+				windowStart = (window.time_since_epoch() - zoneInfo.offset).count();
+				windowEnd = windowStart + (w.end - w.start) * 60;
+			}
 
-#ifdef _DEBUG
-	cout << "Schedule before merge: " << endl;
-	for (int i = 0; i < 7; i++)
-	{
-		for (int j = 0; j < spans[i].size(); j++)
-		{
-			auto k = spans[i][j];
-			cout << FormatSpan(k);
-		}
-		cout << endl;
-	}
-	cout << endl;
-#endif
+			if (triggerDirty || window != triggerFor)
+			{
+				int32_t from = asleep ? w.end : minuteOfWeek;
+				local_days base = weekStart;
+				const WeekIndex* index = active;
+				if (from >= WeekIndex::minutesPerWeek)
+				{
+					from -= WeekIndex::minutesPerWeek;
+					base += weeks{ 1 };
+					if (snapshot->scheduleZone != NULL) index = &projections.Get(snapshot->weekIndex, snapshot->scheduleZone, base);
+				}
 
-	for (int i = 0; i < 7; i++)
-	{
-		sort(spans[i].begin(), spans[i].end());
+				hasNext = index->Next(from, w) != NULL;
+				if (hasNext && snapshot->scheduleZone != NULL && w.start >= WeekIndex::minutesPerWeek)
+				{
+					// A DST change on either side can shift next week's projection
+					base += weeks{ 1 };
+					hasNext = projections.Get(snapshot->weekIndex, snapshot->scheduleZone, base).Next(0, w) != NULL;
+				}
+				next = base + minutes(w.start);
+			}
+		}
 
-		for (size_t j = 0; j < spans[i].size() - 1;)
+		bool newWindow = false;
+		if (triggerDirty || window != triggerFor)
 		{
-			TimeSpan& a = spans[i][j];
-			const TimeSpan& b = spans[i][j + 1];
-			if (a.overlapping(b))
+			triggerDirty = false;
+			newWindow = asleep && window != triggerFor;
+			if (newWindow) journal.Append(JournalKind::Window, snapshot->hash, windowStart, windowEnd);
+			triggerFor = window;
+
+			if (hasNext && next != posted)
 			{
-				a.start = min(a.start, b.start);
-				a.end = max(a.end, b.end);
-				spans[i].erase(spans[i].begin() + j + 1);
+				Registration r;
+				r.next = next;
+				r.onLogon = snapshot->onLogon;
+
+				// A full queue means the backend is behind; try again next pass
+				if (backend.Post(r)) posted = next;
+				else triggerDirty = true;
 			}
-			else j++;
 		}
-	}
 
-	totalSleepTime = { 0, 0 };
+		int64_t registered = backend.registered;
+		if (registered != 0 && registered != journal.state.trigger) journal.Append(JournalKind::Trigger, snapshot->hash, registered);
 
-	for (int i = 0; i < 7; i++)
-	{
-		for (size_t j = spans[i].size(); j--;)
+		if (!asleep) break;
+
+		// Suspend records of later passes in the same window replace each
+		// other in memory, so the disk only waits once per window
+		journal.Append(JournalKind::Suspend, snapshot->hash, duration_cast<seconds>(now.time_since_epoch()).count());
+		if (newWindow) journal.Flush();
+
+		steady_clock::duration decided = steady_clock::now() - decideStart;
+		stats.worstDecision = max(stats.worstDecision, decided);
+		stats.passes++;
+#ifdef _DEBUG
+		cout << "Sleep (decided in " << duration_cast<microseconds>(decided).count() << " us)" << endl;
+#endif
+		backend.power.Suspend(PowerBackend::noWake);
+		this_thread::sleep_for(milliseconds(snapshot->sleepInterval));
+
+#ifdef COUNT_ALLOCATIONS
+		// The first pass may warm up stdio buffers, every later pass must not allocate
+		if (steadyAllocations != SIZE_MAX && allocationCount != steadyAllocations)
 		{
-			totalSleepTime += spans[i][j].length() + DoubleTime::one_minute;
+			cout << "Suspend loop allocated " << allocationCount - steadyAllocations << " time(s)." << endl;
+			exit(1);
 		}
+		steadyAllocations = allocationCount;
+#endif
 	}
 
-	const int maxSleepTime = (7 * 24 - 1) * 60; // All week, except for one hour
-
-	if (totalSleepTime.to_minutes() > maxSleepTime)
+#ifdef _DEBUG
+	if (snapshot->scheduleZone != NULL)
 	{
-		throw exception(format("Schedule file sleeps for too long! ({} day(s), {} hour(s), {} minute(s)).", totalSleepTime.hour / 24, totalSleepTime.hour % 24, totalSleepTime.minute).c_str());
+		cout << format("Projection cache ({}): {} hit(s), {} miss(es), {} byte(s).", snapshot->scheduleZone->name(), projections.hits, projections.misses, projections.MemoryBytes()) << endl;
 	}
+#endif
 }
 
-void SetPrivilege(const wstring& privilege, bool enable)
+// Runs the timing and backend threads against the stand-in, with every
+// registration stalled by delay, and swaps between two schedules on every
+// pass so each pass posts a new trigger. Fails if any suspend decision took
+// longer than a few milliseconds, which only happens if the timing thread
+// ends up waiting on the backend.
+int StressTimer(chrono::milliseconds delay, int passes)
 {
-	HANDLE hToken;
-	OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken);
+	using namespace std::chrono;
+	const steady_clock::duration maxDecision = milliseconds(5);
 
-	TOKEN_PRIVILEGES tp;
-	if (!LookupPrivilegeValue(NULL, privilege.c_str(), &tp.Privileges[0].Luid))
-	{
-		throw exception(format("LookupPrivilegeValue error: {}", GetLastError()).c_str());
-	}
+	local_seconds now = floor<seconds>(current_zone()->to_local(system_clock::now()));
+	local_days day = floor<days>(now);
+	int32_t minuteOfWeek = weekday{ day }.c_encoding() * WeekIndex::minutesPerDay + (int32_t)floor<minutes>(now - day).count();
 
-	tp.PrivilegeCount = 1;
-	tp.Privileges[0].Attributes = enable ? SE_PRIVILEGE_ENABLED : 0;
+	// Both are asleep now and differ only in the window after this one
+	auto make = [&](int32_t after)
+	{
+		ScheduleSnapshot s;
+		s.weekIndex.SetRange(minuteOfWeek - 60, minuteOfWeek + 60);
+		s.weekIndex.SetRange(minuteOfWeek + after, minuteOfWeek + after + 30);
+		s.weekIndex.Compile();
+		s.hash = Fnv1a(s.weekIndex.bits, sizeof(s.weekIndex.bits));
+		return make_shared<const ScheduleSnapshot>(move(s));
+	};
+	shared_ptr<const ScheduleSnapshot> schedules[] = { make(180), make(240) };
+
+	RecordingBackend recorder;
+	recorder.delay = delay;
+	Backend backend(recorder);
+	SnapshotQueue snapshots;
+	Journal journal(nullptr);
+	TimerStats stats;
+
+	atomic<bool> done = false;
+	auto begin = steady_clock::now();
+	thread backendThread(RunBackend, ref(backend));
+	thread timerThread([&]()
+	{
+		RunTimer(schedules[0], snapshots, backend, journal, local_seconds{}, stats);
+		done = true;
+	});
 
-	if (!AdjustTokenPrivileges(
-		hToken,
-		FALSE,
-		&tp,
-		sizeof(TOKEN_PRIVILEGES),
-		(PTOKEN_PRIVILEGES)NULL,
-		(PDWORD)NULL
-	))
+	// One swap per pass; stop early if the timing thread woke up by itself
+	for (int i = 1; i <= passes && !done; i++)
 	{
-		throw exception(format("AdjustTokenPrivileges error: {}", GetLastError()).c_str());
+		size_t seen = stats.passes;
+		while (stats.passes == seen && !done) this_thread::yield();
+		while (!snapshots.Push(schedules[i % 2]) && !done) this_thread::yield();
 	}
 
-	if (GetLastError() == ERROR_NOT_ALL_ASSIGNED)
+	// An empty schedule is awake, which ends the run
+	while (!snapshots.Push(make_shared<const ScheduleSnapshot>())) this_thread::yield();
+	timerThread.join();
+	auto elapsed = steady_clock::now() - begin;
+	backend.Stop();
+	backendThread.join();
+
+	size_t registrations = recorder.count - stats.passes;
+	cout << format("{} pass(es) in {} ms against a {} ms backend, {} registration(s), worst decision {} us.",
+		stats.passes.load(), duration_cast<milliseconds>(elapsed).count(), delay.count(), registrations, duration_cast<microseconds>(stats.worstDecision).count()) << endl;
+
+	if (stats.worstDecision > maxDecision)
 	{
-		throw exception("The token does not have the specified privilege.");
+		cout << format("Decisions must take under {} us.", duration_cast<microseconds>(maxDecision).count()) << endl;
+		return 1;
 	}
+	return 0;
 }
 
-#ifdef _DEBUG
+// Console builds: debug, and the allocation check so its failure is seen
+#if defined(_DEBUG) || defined(COUNT_ALLOCATIONS)
 int main()
 #else
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine, int nCmdShow)
@@ -789,35 +1498,160 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 	memcpy(execPath, fileName, sizeof(fileName));
 	PathCchRemoveFileSpec(execPath, sizeof(fileName) / sizeof(wchar_t));
 
-	try
+	// --stand-in runs the whole scheduler against the recording backend:
+	// nothing is suspended or registered, every call is listed at the end
+	bool standIn = __argc > 1 && strcmp(__argv[1], "--stand-in") == 0;
+	WindowsBackend windowsBackend(L'"' + wstring(fileName) + L'"', wstring(execPath));
+	RecordingBackend recordingBackend;
+	PowerBackend& power = standIn ? (PowerBackend&)recordingBackend : windowsBackend;
+
+#ifdef _DEBUG
+	if (__argc > 1 && strcmp(__argv[1], "--benchmark-backends") == 0)
 	{
-		SetPrivilege(SE_SHUTDOWN_NAME, true);
+		// The stand-in's cost is the floor for the suspend path; the real
+		// backend is only asked for what is safe to repeat
+		int iterations = __argc > 2 ? atoi(__argv[2]) : 100000;
+		BackendTiming recorded = BenchmarkBackend(recordingBackend, iterations, true, true);
+		BackendTiming windows = BenchmarkBackend(windowsBackend, max(iterations / 1000, 1), false, false);
+
+		cout << format("{}: privilege {:.0f} ns, suspend {:.0f} ns, relaunch {:.0f} ns.", recordingBackend.Name(), recorded.privilege, recorded.suspend, recorded.relaunch) << endl;
+		cout << format("{}: privilege {:.0f} ns.", windowsBackend.Name(), windows.privilege) << endl;
+		return 0;
+	}
+#endif
+
+	if (__argc > 1 && strcmp(__argv[1], "--stress-timer") == 0)
+	{
+		return StressTimer(chrono::milliseconds(__argc > 2 ? atoi(__argv[2]) : 500), __argc > 3 ? atoi(__argv[3]) : 10000);
+	}
+
+	if (__argc > 2 && strcmp(__argv[1], "--import-ics") == 0)
+	{
+		try
+		{
+			ImportFile(__argv[2]);
+			return 0;
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Error importing calendar:" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
+	}
+
+	if (__argc > 1 && strcmp(__argv[1], "--benchmark-ics") == 0)
+	{
+		try
+		{
+			return BenchmarkICalendar(__argc > 2 ? (size_t)atoll(__argv[2]) : 100000, __argc > 3 ? (unsigned)atoi(__argv[3]) : 1);
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Error importing calendar:" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
+	}
+
+	if (__argc > 2 && strcmp(__argv[1], "--report") == 0)
+	{
+		try
+		{
+			ReportFiles(__argv[2], __argc - 3, __argv + 3);
+			return 0;
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Error writing report:" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
 	}
+
+	if (__argc > 2 && strcmp(__argv[1], "--fuzz") == 0)
+	{
+		return FuzzSchedules(atoi(__argv[2]), __argc > 3 ? (unsigned)atoi(__argv[3]) : random_device()());
+	}
+
+	if (__argc > 2 && strcmp(__argv[1], "--compile-bundle") == 0)
+	{
+		try
+		{
+			CompileBundle(__argv[2], __argc - 3, __argv + 3);
+			return 0;
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Error compiling bundle:" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
+	}
+
+	try
+	{
+		LoadSchedule();
+	}	
 	catch (const std::exception& e)
 	{
-		cout << "Cannot gain shutdown permission:" << endl;
+		cout << "Error parsing file:" << endl;
 		cout << e.what() << endl;
 		return 1;
 	}
 
+	if (__argc > 1 && strcmp(__argv[1], "--benchmark-index") == 0)
+	{
+		BenchmarkIndex(__argc > 2 ? atoi(__argv[2]) : 1000000);
+		return 0;
+	}
+
+	if (__argc > 1 && strcmp(__argv[1], "--serve") == 0)
+	{
+		try
+		{
+			QueryService(weekIndex, scheduleZone != NULL ? scheduleZone : current_zone(), wstring(execPath) + L"\\" + querySocketName).Run();
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Query service stopped:" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
+	}
+
+	if (__argc > 2 && strcmp(__argv[1], "--export-ics") == 0)
+	{
+		try
+		{
+			ExportFile(__argv[2], __argc > 3 ? atoi(__argv[3]) : 0);
+			return 0;
+		}
+		catch (const std::exception& e)
+		{
+			cout << "Error exporting calendar:" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
+	}
+
+	// Only the scheduler itself needs the privilege, the modes above work offline
 	try
 	{
-		ParseFile();
-	}	
+		power.AcquirePrivilege();
+	}
 	catch (const std::exception& e)
 	{
-		cout << "Error parsing file:" << endl;
+		cout << "Cannot gain shutdown permission:" << endl;
 		cout << e.what() << endl;
 		return 1;
 	}
 
-	int tswd = -1;
-	TimeSpan* ts = NULL;
-	chrono::local_time<chrono::system_clock::duration> tp = zoned_time{ current_zone(), system_clock::now() }.get_local_time();
-	int wd;
+#ifdef _DEBUG
+	local_time<system_clock::duration> tp = current_zone()->to_local(system_clock::now());
 	hh_mm_ss<minutes> t{ floor<minutes>(tp) - floor<days>(tp) };
 
-#ifdef _DEBUG
+
 	cout << "Schedule after merge: " << endl;
 	for (int i = 0; i < 7; i++)
 	{
@@ -830,74 +1664,75 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 	cout << endl;
 #endif
 
-	do
+	shared_ptr<const ScheduleSnapshot> snapshot = TakeSnapshot();
+
+	// Resume from what the last run recorded, if it ran the same schedule
+#ifdef _DEBUG
+	auto resumeStart = steady_clock::now();
+#endif
+	// Stand-in runs never registered anything, keep them out of the real journal
+	Journal journal(standIn ? "schedule.stand-in.journal" : journalName);
+	if (!journal.IsOpen()) cout << "Cannot open journal, starting from scratch." << endl;
+
+	local_time<seconds> registered{};
+	if (journal.state.records > 0 && journal.state.hash == snapshot->hash)
 	{
-		tp = zoned_time{ current_zone(), system_clock::now() }.get_local_time();
-		// Sun - Sat, 0-6
-		wd = weekday{ floor<days>(tp) }.c_encoding();
-		t = hh_mm_ss{ floor<minutes>(tp) - floor<days>(tp) };
+		const time_zone* scheduleClock = snapshot->scheduleZone != NULL ? snapshot->scheduleZone : current_zone();
+		sys_seconds now = floor<seconds>(system_clock::now());
+		local_seconds firstStart, firstEnd;
+		int missed = MissedWindows(*snapshot, scheduleClock->to_local(sys_seconds{ seconds{ journal.state.lastSeen } }), scheduleClock->to_local(now), firstStart, firstEnd);
 
-		if (ts == NULL || wd != tswd || !ts->contains(t))
+		if (missed > 0)
 		{
-			ts = NULL;
-			for (size_t i = 0; i < spans[wd].size(); i++)
-			{
-				if (spans[wd][i].contains(t))
-				{
-					ts = &(spans[wd][i]);
-					tswd = wd;
-					break;
-				}
-			}
+			// The Task Scheduler did not start us for these, so its trigger cannot be trusted either
+			cout << format("Missed {} sleep window(s) while not running, the first from {:%F %T} to {:%F %T}.", missed, firstStart, firstEnd) << endl;
+			journal.Append(JournalKind::Missed, snapshot->hash, scheduleClock->to_sys(firstStart, choose::earliest).time_since_epoch().count(), scheduleClock->to_sys(firstEnd, choose::earliest).time_since_epoch().count());
 		}
-		else
+		else if (journal.state.triggerHash == snapshot->hash && journal.state.trigger > now.time_since_epoch().count())
 		{
-#ifdef _DEBUG
-			cout << "Sleep" << endl;
-			getchar();
-#else
-			SetSuspendState(false, false, false);
-			Sleep(sleepInterval);
-#endif
+			// Still pending, no need to register it again
+			registered = current_zone()->to_local(sys_seconds{ seconds{ journal.state.trigger } });
 		}
 	}
-	while (ts != NULL);
+#ifdef _DEBUG
+	cout << format("Resumed from {} journal record(s) in {} us.", journal.state.records, duration_cast<microseconds>(steady_clock::now() - resumeStart).count()) << endl;
+#endif
 
-	bool set = false;
-	year_month_day next_date = year_month_day(floor<days>(tp));
-	DoubleTime next_start;
+	SnapshotQueue snapshots;
+	Backend backend(power);
 
-	DoubleTime t2{ t.hours().count(), t.minutes().count() };
-	for (size_t j = 0; j < spans[wd].size(); j++)
-	{
-		if (spans[wd][j].start < t2) continue;
-		next_start = spans[wd][j].start;
-		set = true;
-		break;
-	}
+	HANDLE stopReload = CreateEvent(NULL, TRUE, FALSE, NULL);
+	thread backendThread(RunBackend, ref(backend));
+	thread reloadThread(RunReload, ref(snapshots), stopReload, snapshot->hash);
+
+	TimerStats stats;
+	RunTimer(snapshot, snapshots, backend, journal, registered, stats);
+
+	// Let the backend finish registering the last trigger before exiting
+	SetEvent(stopReload);
+	reloadThread.join();
+	CloseHandle(stopReload);
+	backend.Stop();
+	backendThread.join();
 
-	if (!set)
+	if (standIn)
 	{
-		for (int i = 1; i < 7; i++)
+		const char* kinds[] = { "AcquirePrivilege", "Suspend", "RelaunchAt" };
+		size_t count = recordingBackend.count;
+		cout << format("Stand-in backend: {} call(s).", count) << endl;
+		for (size_t i = count > RecordingBackend::capacity ? count - RecordingBackend::capacity : 0; i < count; i++)
 		{
-			if (spans[(wd + i) % 7].empty()) continue;
-			AddDays(next_date, i);
-			next_start = spans[wd][0].start;
-			set = true;
-			break;
+			const RecordingBackend::Call& call = recordingBackend[i];
+			if (call.kind == RecordingBackend::CallKind::RelaunchAt) cout << format("{} {:%F %T}{}", kinds[(int)call.kind], current_zone()->to_local(call.at), call.onLogon ? " (and at log-on)" : "") << endl;
+			else cout << kinds[(int)call.kind] << endl;
 		}
 	}
 
-	if (!set) return 0;
-
-	time_point next_time = local_days(next_date) + hours(next_start.hour) + minutes(next_start.minute);
-
-	TaskService tserv;
-	bool result = tserv.ScheduleEvent(L'"' + wstring(fileName) + L'"', wstring(execPath), FormatTime(next_time), onLogon);
+	if (backend.registered != 0 && backend.registered != journal.state.trigger) journal.Append(JournalKind::Trigger, journal.state.hash, backend.registered);
+	journal.Flush();
 
 #ifdef _DEBUG
-	wcout << (result ? format(L"Scheduled next check: {}",FormatTime(next_time)) : L"Failed to schedule task.") << endl;
 	getchar();
 #endif
-	return result ? 0 : 1;
-}
\ No newline at end of file
+	return backend.failed ? 1 : 0;
+}
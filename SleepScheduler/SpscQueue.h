@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. Push and Pop never block and never allocate.
+template <class T, size_t N>
+class SpscQueue
+{
+	static_assert(N > 0 && (N & (N - 1)) == 0, "Queue size must be a power of two");
+
+private:
+	T items[N];
+	// Each index is only written by one side; keep them on separate cache lines
+	alignas(64) std::atomic<size_t> head = 0; // Next slot to pop
+	alignas(64) std::atomic<size_t> tail = 0; // Next slot to push
+
+public:
+	// Returns false if the queue is full
+	bool Push(T item)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N) return false;
+
+		items[t & (N - 1)] = std::move(item);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty
+	bool Pop(T& item)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+
+		item = std::move(items[h & (N - 1)]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+};